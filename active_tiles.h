@@ -0,0 +1,84 @@
+#pragma once
+
+// Square tiles of a grid which hold anything worth computing, so passes
+// can skip the others. Built from the largest value of each tile, see
+// FluidSolver::update_density_tiles(). When most tiles are active the map
+// falls back to dense, where all of them are set and passes run as usual.
+
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+struct ActiveTiles {
+    int nx, ny;
+    // cells per side, a multiple of the widest SIMD register
+    int tile;
+    int tiles_x, tiles_y;
+    // 1 for active tiles, x + y*tiles_x
+    std::vector<uint8_t> mask;
+    int num_active = 0;
+    bool dense = true;
+
+    // for dilate()
+    std::vector<uint8_t> scratch;
+
+    ActiveTiles(int nx, int ny, int tile = 32):
+        nx(nx), ny(ny), tile(tile),
+        tiles_x((nx + tile - 1)/tile),
+        tiles_y((ny + tile - 1)/tile),
+        mask(tiles_x*tiles_y),
+        scratch(tiles_x*tiles_y)
+    {
+        set_dense();
+    }
+
+    int size() const {
+        return tiles_x*tiles_y;
+    }
+
+    float fraction() const {
+        return float(num_active)/size();
+    }
+
+    void set_dense(){
+        std::fill(mask.begin(), mask.end(), 1);
+        num_active = size();
+        dense = true;
+    }
+
+    // cells [x0, x1) x [y0, y1) of tile i
+    void bounds(int i, int &x0, int &x1, int &y0, int &y1) const {
+        x0 = i % tiles_x*tile;
+        y0 = i / tiles_x*tile;
+        x1 = std::min(x0 + tile, nx);
+        y1 = std::min(y0 + tile, ny);
+    }
+
+    // Sets every tile within r tiles of an active one, wrapping around
+    // like the periodic grids. One pass along x, one along y.
+    void dilate(int r){
+        r = std::min(r, std::max(tiles_x, tiles_y));
+        if (r <= 0) return;
+        for (int pass = 0; pass < 2; pass++){
+            const std::vector<uint8_t> &src = pass == 0 ? mask : scratch;
+            std::vector<uint8_t> &dst = pass == 0 ? scratch : mask;
+            for (int ty = 0; ty < tiles_y; ty++) for (int tx = 0; tx < tiles_x; tx++){
+                uint8_t any = 0;
+                for (int d = -r; d <= r && !any; d++){
+                    int x = pass == 0 ? ((tx + d) % tiles_x + tiles_x) % tiles_x : tx;
+                    int y = pass == 1 ? ((ty + d) % tiles_y + tiles_y) % tiles_y : ty;
+                    any = src[x + y*tiles_x];
+                }
+                dst[tx + ty*tiles_x] = any;
+            }
+        }
+    }
+
+    // counts the active tiles and falls back to dense above max_fraction
+    void finish(float max_fraction){
+        num_active = 0;
+        for (uint8_t m : mask) num_active += m;
+        dense = false;
+        if (fraction() > max_fraction) set_dense();
+    }
+};
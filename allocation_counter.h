@@ -0,0 +1,46 @@
+#pragma once
+
+// Counts heap allocations of the whole program by replacing the global
+// operator new. Include in exactly one translation unit.
+
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+
+std::atomic<long> heap_allocations(0);
+
+void* counted_allocate(size_t bytes, size_t alignment){
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (bytes == 0) bytes = 1;
+#ifdef _WIN32
+    void *p = _aligned_malloc(bytes, alignment);
+#else
+    // aligned_alloc wants a multiple of the alignment
+    bytes = (bytes + alignment - 1)/alignment*alignment;
+    void *p = aligned_alloc(alignment, bytes);
+#endif
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void counted_free(void *p){
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+void* operator new  (size_t bytes){ return counted_allocate(bytes, alignof(max_align_t)); }
+void* operator new[](size_t bytes){ return counted_allocate(bytes, alignof(max_align_t)); }
+void* operator new  (size_t bytes, std::align_val_t alignment){ return counted_allocate(bytes, size_t(alignment)); }
+void* operator new[](size_t bytes, std::align_val_t alignment){ return counted_allocate(bytes, size_t(alignment)); }
+
+void operator delete  (void *p) noexcept { counted_free(p); }
+void operator delete[](void *p) noexcept { counted_free(p); }
+void operator delete  (void *p, size_t) noexcept { counted_free(p); }
+void operator delete[](void *p, size_t) noexcept { counted_free(p); }
+void operator delete  (void *p, std::align_val_t) noexcept { counted_free(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { counted_free(p); }
+void operator delete  (void *p, size_t, std::align_val_t) noexcept { counted_free(p); }
+void operator delete[](void *p, size_t, std::align_val_t) noexcept { counted_free(p); }
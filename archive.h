@@ -0,0 +1,590 @@
+#pragma once
+
+// Compressed time series of the solver fields, e.g. every Nth frame of a
+// run for later analysis.
+//
+//     ArchiveWriter writer;
+//     writer.open("run.arc", nx, ny, 3, 1e-3f);
+//     const Grid<float> *fields[] = {&density, &u, &v};
+//     writer.submit(frame, fields);      // copies, compressed in the background
+//     writer.close();                    // writes the index
+//
+//     ArchiveReader reader;
+//     reader.open("run.arc");
+//     reader.read(k, fields);            // any frame, in any order
+//
+// Each value is quantized to a multiple of the quantum (or, with quantum
+// 0, taken bit for bit). Each channel is then predicted from its left and
+// lower neighbours, either as is or, except in keyframes, as the change
+// since the previous frame, whichever looks smaller. The residuals are
+// written as variable length integers with runs of zeros collapsed.
+// An index at the end of the file gives the offset of every frame, so the
+// reader maps the file and decodes only from the keyframe before the
+// frame it is asked for, or from the frame it decoded last.
+//
+// File: ArchiveHeader, frames, ArchiveEntry for every frame, ArchiveTrailer.
+// A frame holds for each channel its size in bytes (uint32), an
+// ArchiveMode byte and the codes.
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "grid.h"
+#include "mapped_file.h"
+#include "timer.h"
+
+const char ARCHIVE_MAGIC[8] = {'F', 'L', 'U', 'I', 'D', 'A', 'R', 'C'};
+const uint32_t ARCHIVE_VERSION = 1;
+// density, u and v, the most a frame may have
+const int ARCHIVE_MAX_CHANNELS = 3;
+
+struct ArchiveHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t nx, ny;
+    int32_t channels;
+    // quantization step, 0 for lossless
+    float quantum;
+    // every keyframe_interval-th frame does not depend on the previous one
+    int32_t keyframe_interval;
+};
+
+struct ArchiveEntry {
+    uint64_t offset;
+    // step of the solver the frame was taken at
+    uint64_t frame;
+    uint32_t bytes;
+    uint32_t keyframe;
+};
+
+struct ArchiveTrailer {
+    uint64_t index_offset;
+    uint64_t count;
+    char magic[8];
+};
+
+// the values of a channel are counted with int
+inline bool archive_valid_size(int nx, int ny, int channels){
+    return nx >= 1 && ny >= 1 && channels >= 1 && channels <= ARCHIVE_MAX_CHANNELS &&
+        int64_t(nx)*ny <= INT_MAX;
+}
+
+// Float bits as an integer which is ordered like the floats, so nearby
+// values have nearby keys. Its own inverse.
+inline uint32_t archive_float_key(uint32_t bits){
+    return bits ^ ((uint32_t)((int32_t)bits >> 31) >> 1);
+}
+
+// interior cells to integers, row by row
+void archive_quantize(const float *values, int n, float quantum, uint32_t *out){
+    if (quantum == 0.0f){
+        for (int i = 0; i < n; i++){
+            uint32_t bits;
+            memcpy(&bits, &values[i], sizeof(bits));
+            out[i] = archive_float_key(bits);
+        }
+        return;
+    }
+    float scale = 1.0f/quantum;
+    // far beyond any velocity or density, keeps the conversion defined
+    const float limit = 1 << 30;
+    for (int i = 0; i < n; i++){
+        float q = values[i]*scale;
+        // NaN would pass the clamp, it becomes zero
+        q = q == q ? std::min(std::max(q, -limit), limit) : 0.0f;
+        out[i] = (uint32_t)(int32_t)lrintf(q);
+    }
+}
+
+void archive_dequantize(const uint32_t *in, int n, float quantum, float *values){
+    if (quantum == 0.0f){
+        for (int i = 0; i < n; i++){
+            uint32_t bits = archive_float_key(in[i]);
+            memcpy(&values[i], &bits, sizeof(bits));
+        }
+        return;
+    }
+    for (int i = 0; i < n; i++) values[i] = (int32_t)in[i]*quantum;
+}
+
+inline void archive_put_varint(std::vector<uint8_t> &out, uint64_t x){
+    while (x >= 0x80){
+        out.push_back(uint8_t(x) | 0x80);
+        x >>= 7;
+    }
+    out.push_back(uint8_t(x));
+}
+
+// false at the end of the data or on an overlong code
+inline bool archive_get_varint(const uint8_t *&p, const uint8_t *end, uint64_t &x){
+    x = 0;
+    for (int shift = 0; shift < 64; shift += 7){
+        if (p == end) return false;
+        uint8_t byte = *p++;
+        x |= uint64_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// LOCO-I median predictor of cell (x, y) from its left (a), lower (b) and
+// lower left (c) neighbours: a or b across an edge, a + b - c where smooth
+inline uint32_t archive_predict(const uint32_t *row, const uint32_t *below, int x, int y){
+    if (y == 0) return x ? row[x - 1] : 0;
+    if (x == 0) return below[0];
+    // the median of a, b and a + b - c, without branches
+    int64_t a = (int32_t)row[x - 1];
+    int64_t b = (int32_t)below[x];
+    int64_t c = (int32_t)below[x - 1];
+    int64_t gradient = a + b - c;
+    return (uint32_t)std::max(std::min(a, b), std::min(std::max(a, b), gradient));
+}
+
+inline uint32_t archive_zigzag(uint32_t r){
+    return (r << 1) ^ (uint32_t)((int32_t)r >> 31);
+}
+
+inline uint32_t archive_unzigzag(uint32_t z){
+    return (z >> 1) ^ -(z & 1);
+}
+
+// Codes are zigzag encoded residuals shifted up by one, or runs of zero
+// residuals as count*2 + 1. Runs continue across rows.
+void archive_encode(const uint32_t *d, int nx, int ny, std::vector<uint8_t> &out){
+    uint64_t run = 0;
+    for (int y = 0; y < ny; y++){
+        const uint32_t *row = d + size_t(y)*nx;
+        for (int x = 0; x < nx; x++){
+            uint32_t z = archive_zigzag(row[x] - archive_predict(row, row - nx, x, y));
+            if (z == 0){
+                run++;
+                continue;
+            }
+            if (run){
+                archive_put_varint(out, run*2 + 1);
+                run = 0;
+            }
+            archive_put_varint(out, uint64_t(z)*2);
+        }
+    }
+    if (run) archive_put_varint(out, run*2 + 1);
+}
+
+bool archive_decode(const uint8_t *p, const uint8_t *end, int nx, int ny, uint32_t *d){
+    uint64_t run = 0;
+    for (int y = 0; y < ny; y++){
+        uint32_t *row = d + size_t(y)*nx;
+        for (int x = 0; x < nx; x++){
+            uint32_t r = 0;
+            if (run){
+                run--;
+            } else {
+                uint64_t code;
+                if (!archive_get_varint(p, end, code)) return false;
+                if (code & 1){
+                    run = (code >> 1) - 1;
+                } else {
+                    r = archive_unzigzag(uint32_t(code >> 1));
+                }
+            }
+            row[x] = archive_predict(row, row - nx, x, y) + r;
+        }
+    }
+    return run == 0 && p == end;
+}
+
+// rough size of the codes of d, from every eighth row
+uint64_t archive_estimate(const uint32_t *d, int nx, int ny){
+    uint64_t bits = 0;
+    for (int y = 1; y < ny; y += 8){
+        const uint32_t *row = d + size_t(y)*nx;
+        for (int x = 0; x < nx; x++){
+            uint32_t z = archive_zigzag(row[x] - archive_predict(row, row - nx, x, y));
+            bits += z ? 33 - __builtin_clz(z) : 0;
+        }
+    }
+    return bits;
+}
+
+// what the predictor runs on, stored as the first byte of each channel
+enum ArchiveMode {
+    // the values
+    ARCHIVE_SPATIAL,
+    // the change since the previous frame
+    ARCHIVE_TEMPORAL,
+};
+
+// Compresses and writes frames on a background thread. submit() copies
+// the fields into one of a few buffers and waits only if all of them are
+// still queued.
+struct ArchiveWriter {
+    FILE *fp = nullptr;
+    ArchiveHeader header;
+
+    // channels*nx*ny interior values per buffer
+    std::vector<std::vector<float>> buffers;
+    std::vector<uint64_t> buffer_frames;
+    std::vector<int> free_buffers;
+    std::vector<int> queue;
+    int queue_head = 0;
+    int queue_count = 0;
+
+    // used only by the writer thread
+    std::vector<uint32_t> current, previous, change;
+    std::vector<uint8_t> codes;
+    std::vector<ArchiveEntry> index;
+    uint64_t position = 0;
+
+    std::mutex mutex;
+    std::condition_variable queued_condition;
+    std::condition_variable free_condition;
+    std::thread thread;
+    bool closing = false;
+    bool failed = false;
+
+    long frames = 0;
+    uint64_t raw_bytes = 0;
+    uint64_t compressed_bytes = 0;
+    // writer thread time spent compressing, and caller time spent waiting
+    double compress_seconds = 0.0;
+    double stall_seconds = 0.0;
+
+    ArchiveWriter() = default;
+    ArchiveWriter(const ArchiveWriter&) = delete;
+    ArchiveWriter& operator = (const ArchiveWriter&) = delete;
+
+    ~ArchiveWriter(){
+        close();
+    }
+
+    bool open(const char *path, int nx, int ny, int channels, float quantum, int keyframe_interval = 32, int num_buffers = 4){
+        close();
+        if (!archive_valid_size(nx, ny, channels)){
+            printf("Cannot archive %i channels of %i x %i\n", channels, nx, ny);
+            return false;
+        }
+        fp = fopen(path, "wb");
+        if (!fp){
+            printf("Could not open %s\n", path);
+            return false;
+        }
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, ARCHIVE_MAGIC, sizeof(header.magic));
+        header.version = ARCHIVE_VERSION;
+        header.nx = nx;
+        header.ny = ny;
+        header.channels = channels;
+        header.quantum = quantum;
+        header.keyframe_interval = std::max(keyframe_interval, 1);
+        failed = fwrite(&header, sizeof(header), 1, fp) != 1;
+        position = sizeof(header);
+
+        size_t n = size_t(channels)*nx*ny;
+        buffers.assign(num_buffers, std::vector<float>(n));
+        buffer_frames.assign(num_buffers, 0);
+        free_buffers.clear();
+        for (int i = num_buffers - 1; i >= 0; i--) free_buffers.push_back(i);
+        queue.assign(num_buffers, -1);
+        queue_head = 0;
+        queue_count = 0;
+        current.resize(n);
+        previous.resize(n);
+        change.resize(size_t(nx)*ny);
+        // worst case of five bytes per value
+        codes.reserve(5*size_t(nx)*ny + 16);
+        index.clear();
+        // grows only on long runs
+        index.reserve(1024);
+        closing = false;
+        frames = 0;
+        raw_bytes = compressed_bytes = 0;
+        compress_seconds = stall_seconds = 0.0;
+
+        thread = std::thread(&ArchiveWriter::writer_loop, this);
+        return true;
+    }
+
+    bool is_open() const {
+        return fp != nullptr;
+    }
+
+    // fields has header.channels grids of nx*ny, stored as float or a type
+    // which converts to it
+    template <typename T>
+    void submit(uint64_t frame, const Grid<T> *const *fields){
+        std::unique_lock<std::mutex> lock(mutex);
+        if (free_buffers.empty()){
+            double t = sec();
+            free_condition.wait(lock, [this]{ return !free_buffers.empty(); });
+            stall_seconds += sec() - t;
+        }
+        int buffer = free_buffers.back();
+        free_buffers.pop_back();
+        lock.unlock();
+
+        int nx = header.nx;
+        int ny = header.ny;
+        float *out = buffers[buffer].data();
+        for (int c = 0; c < header.channels; c++){
+            for (int y = 0; y < ny; y++){
+                std::copy(fields[c]->row(y), fields[c]->row(y) + nx, out);
+                out += nx;
+            }
+        }
+
+        lock.lock();
+        buffer_frames[buffer] = frame;
+        queue[(queue_head + queue_count) % queue.size()] = buffer;
+        queue_count++;
+        lock.unlock();
+        queued_condition.notify_one();
+    }
+
+    // writes the queued frames and the index
+    bool close(){
+        if (!fp) return !failed;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closing = true;
+        }
+        queued_condition.notify_one();
+        thread.join();
+
+        // entries start on 8 bytes, so a mapped index can be read in place
+        uint64_t padding = (8 - position % 8) % 8;
+        uint64_t zero = 0;
+        ArchiveTrailer trailer;
+        trailer.index_offset = position + padding;
+        trailer.count = index.size();
+        memcpy(trailer.magic, ARCHIVE_MAGIC, sizeof(trailer.magic));
+        bool ok = !failed;
+        ok = ok && fwrite(&zero, 1, padding, fp) == padding;
+        ok = ok && fwrite(index.data(), sizeof(ArchiveEntry), index.size(), fp) == index.size();
+        ok = ok && fwrite(&trailer, sizeof(trailer), 1, fp) == 1;
+        ok = fclose(fp) == 0 && ok;
+        fp = nullptr;
+        if (!ok) printf("Could not write the archive\n");
+        failed = !ok;
+        return ok;
+    }
+
+    void print_stats(FILE *out) const {
+        fprintf(out, "archive          %li frames, %.1f MB -> %.1f MB, ratio %.2f, compressed at %.1f MB/s, %f s waiting\n",
+            frames, raw_bytes*1e-6, compressed_bytes*1e-6,
+            compressed_bytes ? double(raw_bytes)/compressed_bytes : 0.0,
+            compress_seconds > 0.0 ? raw_bytes*1e-6/compress_seconds : 0.0,
+            stall_seconds);
+    }
+
+    void writer_loop(){
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;){
+            queued_condition.wait(lock, [this]{ return queue_count > 0 || closing; });
+            if (queue_count == 0) break;
+            int buffer = queue[queue_head];
+            queue_head = (queue_head + 1) % queue.size();
+            queue_count--;
+            lock.unlock();
+
+            double t = sec();
+            write_frame(buffers[buffer].data(), buffer_frames[buffer]);
+            compress_seconds += sec() - t;
+
+            lock.lock();
+            free_buffers.push_back(buffer);
+            free_condition.notify_one();
+        }
+    }
+
+    void write_frame(const float *values, uint64_t frame){
+        int n = header.nx*header.ny;
+        bool keyframe = index.size() % header.keyframe_interval == 0;
+        ArchiveEntry entry = {position, frame, 0, keyframe};
+
+        for (int c = 0; c < header.channels; c++){
+            uint32_t *cur = current.data() + size_t(c)*n;
+            const uint32_t *prev = previous.data() + size_t(c)*n;
+            archive_quantize(values + size_t(c)*n, n, header.quantum, cur);
+
+            // where things stand still the change is cheaper, where they move the values
+            const uint32_t *d = cur;
+            uint8_t mode = ARCHIVE_SPATIAL;
+            if (!keyframe){
+                for (int i = 0; i < n; i++) change[i] = cur[i] - prev[i];
+                if (archive_estimate(change.data(), header.nx, header.ny) < archive_estimate(cur, header.nx, header.ny)){
+                    d = change.data();
+                    mode = ARCHIVE_TEMPORAL;
+                }
+            }
+            codes.clear();
+            codes.push_back(mode);
+            archive_encode(d, header.nx, header.ny, codes);
+            uint32_t bytes = codes.size();
+            if (fwrite(&bytes, sizeof(bytes), 1, fp) != 1 || fwrite(codes.data(), 1, bytes, fp) != bytes){
+                failed = true;
+            }
+            entry.bytes += sizeof(bytes) + bytes;
+        }
+        current.swap(previous);
+
+        position += entry.bytes;
+        index.push_back(entry);
+        frames++;
+        raw_bytes += sizeof(float)*size_t(header.channels)*n;
+        compressed_bytes += entry.bytes;
+    }
+};
+
+// Random access to the frames of an archive. Reading the frame after the
+// last one read decodes only that frame.
+struct ArchiveReader {
+    MappedFile file;
+    // contents of the file where it cannot be mapped
+    std::vector<char> contents;
+    const char *data = nullptr;
+    uint64_t bytes = 0;
+
+    ArchiveHeader header;
+    const ArchiveEntry *index = nullptr;
+    long count = 0;
+
+    // integers of the frame decoded last
+    std::vector<uint32_t> values;
+    std::vector<uint32_t> change;
+    long decoded = -1;
+
+    bool open(const char *path){
+        close();
+        if (file.map(path)){
+            data = file.data;
+            bytes = file.bytes;
+        } else {
+            FILE *fp = fopen(path, "rb");
+            if (!fp){
+                printf("Could not open %s\n", path);
+                return false;
+            }
+            fseek(fp, 0, SEEK_END);
+            contents.resize(std::max(ftell(fp), 0L));
+            fseek(fp, 0, SEEK_SET);
+            bytes = fread(contents.data(), 1, contents.size(), fp);
+            fclose(fp);
+            data = contents.data();
+        }
+
+        ArchiveTrailer trailer;
+        bool ok = bytes >= sizeof(header) + sizeof(trailer);
+        if (ok){
+            memcpy(&header, data, sizeof(header));
+            memcpy(&trailer, data + bytes - sizeof(trailer), sizeof(trailer));
+            ok = memcmp(header.magic, ARCHIVE_MAGIC, sizeof(header.magic)) == 0 &&
+                memcmp(trailer.magic, ARCHIVE_MAGIC, sizeof(trailer.magic)) == 0;
+        }
+        if (!ok){
+            // also an archive whose writer never got to close() it
+            printf("%s is not a complete archive\n", path);
+            close();
+            return false;
+        }
+        if (header.version != ARCHIVE_VERSION){
+            printf("%s has version %u, this build reads version %u\n", path, header.version, ARCHIVE_VERSION);
+            close();
+            return false;
+        }
+        if (trailer.index_offset % 8 || trailer.index_offset + trailer.count*sizeof(ArchiveEntry) + sizeof(trailer) != bytes ||
+            !archive_valid_size(header.nx, header.ny, header.channels)){
+            printf("%s is damaged\n", path);
+            close();
+            return false;
+        }
+        index = (const ArchiveEntry*)(data + trailer.index_offset);
+        count = trailer.count;
+        values.assign(size_t(header.channels)*header.nx*header.ny, 0);
+        change.assign(size_t(header.nx)*header.ny, 0);
+        decoded = -1;
+        return true;
+    }
+
+    void close(){
+        file.unmap();
+        contents.clear();
+        data = nullptr;
+        bytes = 0;
+        index = nullptr;
+        count = 0;
+        decoded = -1;
+    }
+
+    long size() const {
+        return count;
+    }
+
+    // solver step of frame k
+    uint64_t frame(long k) const {
+        return index[k].frame;
+    }
+
+    // frame k into header.channels grids of nx*ny, halos filled, at most
+    // ARCHIVE_MAX_CHANNELS
+    bool read(long k, Grid<float> *const *fields){
+        if (k < 0 || k >= count) return false;
+        long start = k;
+        while (!index[start].keyframe && start > 0) start--;
+        // continue from the frame decoded last where that is closer
+        if (decoded >= start && decoded <= k) start = decoded + 1;
+        for (long j = start; j <= k; j++){
+            if (!decode(j)){
+                decoded = -1;
+                return false;
+            }
+            decoded = j;
+        }
+
+        int nx = header.nx;
+        int ny = header.ny;
+        for (int c = 0; c < header.channels; c++){
+            Grid<float> &grid = *fields[c];
+            const uint32_t *in = values.data() + size_t(c)*nx*ny;
+            for (int y = 0; y < ny; y++){
+                archive_dequantize(in + size_t(y)*nx, nx, header.quantum, grid.row(y));
+            }
+            grid.fill_halo();
+        }
+        return true;
+    }
+
+    bool decode(long k){
+        const ArchiveEntry &entry = index[k];
+        if (entry.offset + entry.bytes > bytes) return false;
+        const uint8_t *p = (const uint8_t*)data + entry.offset;
+        const uint8_t *end = p + entry.bytes;
+        int n = header.nx*header.ny;
+        for (int c = 0; c < header.channels; c++){
+            uint32_t size;
+            if (end - p < (long)sizeof(size)) return false;
+            memcpy(&size, p, sizeof(size));
+            p += sizeof(size);
+            if (size < 1 || uint64_t(end - p) < size) return false;
+            uint8_t mode = p[0];
+            uint32_t *cur = values.data() + size_t(c)*n;
+            if (mode == ARCHIVE_SPATIAL){
+                if (!archive_decode(p + 1, p + size, header.nx, header.ny, cur)) return false;
+            } else if (mode == ARCHIVE_TEMPORAL && !entry.keyframe){
+                // values still hold the previous frame
+                if (!archive_decode(p + 1, p + size, header.nx, header.ny, change.data())) return false;
+                for (int i = 0; i < n; i++) cur[i] += change[i];
+            } else {
+                return false;
+            }
+            p += size;
+        }
+        return p == end;
+    }
+};
@@ -0,0 +1,189 @@
+#pragma once
+
+// Checkpoint files of the solver state, see FluidSolver::save_checkpoint().
+//
+// A fixed size header is followed by the fields, each one the storage of
+// a Grid<float> byte for byte (halo and row padding included) and starting
+// on a page boundary. Where the row layout matches, a loaded checkpoint is
+// mapped privately and the grids point straight into the mapping, so the
+// pages are only read when a step first touches them and copied when it
+// first writes them.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "grid.h"
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+const char CHECKPOINT_MAGIC[8] = {'F', 'L', 'U', 'I', 'D', 'C', 'K', 'P'};
+const uint32_t CHECKPOINT_VERSION = 1;
+// written as is, reads back differently on a machine of the other byte order
+const uint32_t CHECKPOINT_BYTE_ORDER = 0x01020304;
+// fields start on page boundaries so they can be mapped
+const uint64_t CHECKPOINT_ALIGNMENT = 4096;
+
+// u, v and density
+const int CHECKPOINT_FIELDS = 3;
+
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t header_bytes;
+    int32_t nx, ny;
+    // floats from one row of a field to the next and before cell (0, -1)
+    int32_t stride;
+    int32_t left_padding;
+
+    uint64_t frame;
+    uint32_t seed;
+    int32_t iterations;
+    float dt;
+    float vorticity;
+    float mouse_x, mouse_y;
+    float noise;
+    float buoyancy;
+    float gravity;
+    float damping;
+    float fade;
+    int32_t bottom_rows;
+
+    uint64_t field_bytes;
+    uint64_t field_offsets[CHECKPOINT_FIELDS];
+    uint64_t file_bytes;
+};
+
+uint64_t checkpoint_align(uint64_t bytes){
+    return (bytes + CHECKPOINT_ALIGNMENT - 1)/CHECKPOINT_ALIGNMENT*CHECKPOINT_ALIGNMENT;
+}
+
+// fills in everything after the solver state from nx, ny and stride
+void checkpoint_layout(CheckpointHeader &header){
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.byte_order = CHECKPOINT_BYTE_ORDER;
+    header.header_bytes = sizeof(CheckpointHeader);
+    header.field_bytes = sizeof(float)*uint64_t(header.stride)*(header.ny + 2);
+    uint64_t offset = checkpoint_align(sizeof(CheckpointHeader));
+    for (int i = 0; i < CHECKPOINT_FIELDS; i++){
+        header.field_offsets[i] = offset;
+        offset = checkpoint_align(offset + header.field_bytes);
+    }
+    header.file_bytes = offset;
+}
+
+// false with a message if the header does not describe a file this build can read
+bool checkpoint_valid(const CheckpointHeader &header, uint64_t file_bytes, const char *path){
+    if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0){
+        printf("%s is not a checkpoint\n", path);
+        return false;
+    }
+    if (header.byte_order != CHECKPOINT_BYTE_ORDER){
+        printf("%s was written on a machine of the other byte order\n", path);
+        return false;
+    }
+    if (header.version != CHECKPOINT_VERSION || header.header_bytes != sizeof(CheckpointHeader)){
+        printf("%s has version %u, this build reads version %u\n", path, header.version, CHECKPOINT_VERSION);
+        return false;
+    }
+    CheckpointHeader expected = header;
+    if (header.nx < 1 || header.ny < 1 || header.left_padding < 1 || header.stride < header.left_padding + header.nx + 1){
+        printf("%s has an invalid grid size\n", path);
+        return false;
+    }
+    checkpoint_layout(expected);
+    if (memcmp(&expected, &header, sizeof(header)) != 0 || file_bytes < header.file_bytes){
+        printf("%s is truncated or damaged\n", path);
+        return false;
+    }
+    return true;
+}
+
+bool write_zeros(FILE *fp, uint64_t bytes){
+    static const char zeros[4096] = {};
+    while (bytes > 0){
+        size_t n = bytes < sizeof(zeros) ? bytes : sizeof(zeros);
+        if (fwrite(zeros, 1, n, fp) != n) return false;
+        bytes -= n;
+    }
+    return true;
+}
+
+// Writes the header and then one field after the other to path.tmp and
+// renames it to path once everything is on disk, so an interrupted write
+// leaves the previous checkpoint in place.
+bool write_checkpoint(const char *path, const CheckpointHeader &header, const Grid<float> *const *fields){
+    char tmp_path[1024];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *fp = fopen(tmp_path, "wb");
+    if (!fp){
+        printf("Could not open %s\n", tmp_path);
+        return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    uint64_t position = sizeof(header);
+    for (int i = 0; i < CHECKPOINT_FIELDS && ok; i++){
+        ok = write_zeros(fp, header.field_offsets[i] - position);
+        ok = ok && fwrite(fields[i]->memory, 1, header.field_bytes, fp) == header.field_bytes;
+        position = header.field_offsets[i] + header.field_bytes;
+    }
+    ok = ok && write_zeros(fp, header.file_bytes - position);
+    ok = ok && fflush(fp) == 0;
+#ifdef MAPPED_FILE_MMAP
+    ok = ok && fsync(fileno(fp)) == 0;
+#endif
+    ok = fclose(fp) == 0 && ok;
+    // rename() replaces path atomically, except on Windows where it fails
+    // if path exists
+#ifdef _WIN32
+    ok = ok && MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+    ok = ok && rename(tmp_path, path) == 0;
+#endif
+    if (!ok){
+        printf("Could not write %s\n", path);
+        remove(tmp_path);
+    }
+    return ok;
+}
+
+bool read_checkpoint_header(const char *path, CheckpointHeader &header){
+    FILE *fp = fopen(path, "rb");
+    if (!fp){
+        printf("Could not open %s\n", path);
+        return false;
+    }
+    bool ok = fread(&header, sizeof(header), 1, fp) == 1;
+    fseek(fp, 0, SEEK_END);
+    long file_bytes = ftell(fp);
+    fclose(fp);
+    if (!ok){
+        printf("%s is not a checkpoint\n", path);
+        return false;
+    }
+    return checkpoint_valid(header, file_bytes, path);
+}
+
+// Reads the fields into grids of the same size row by row, for when they
+// cannot be mapped or were written with a different row layout.
+bool read_checkpoint_fields(const char *path, const CheckpointHeader &header, Grid<float> *const *fields){
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return false;
+    bool ok = true;
+    for (int i = 0; i < CHECKPOINT_FIELDS && ok; i++){
+        Grid<float> &grid = *fields[i];
+        // rows with their halo cells, x in [-1, nx]
+        for (int y = -1; y <= header.ny && ok; y++){
+            uint64_t cell = uint64_t(header.stride)*(y + 1) + header.left_padding - 1;
+            ok = fseek(fp, header.field_offsets[i] + sizeof(float)*cell, SEEK_SET) == 0;
+            ok = ok && fread(grid.row(y) - 1, sizeof(float), header.nx + 2, fp) == size_t(header.nx + 2);
+        }
+    }
+    fclose(fp);
+    return ok;
+}
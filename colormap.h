@@ -0,0 +1,144 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include "vec2.h"
+#include "grid.h"
+#include "simd.h"
+#include "thread_pool.h"
+#include "active_tiles.h"
+
+uint32_t rgba32(uint32_t r, uint32_t g, uint32_t b, uint32_t a){
+    r = clamp(r, 0u, 255u);
+    g = clamp(g, 0u, 255u);
+    b = clamp(b, 0u, 255u);
+    a = clamp(a, 0u, 255u);
+    return (a << 24) | (b << 16) | (g << 8) | r;
+}
+
+uint32_t rgba(float r, float g, float b, float a){
+    return rgba32(r*256, g*256, b*256, a*256);
+}
+
+enum Palette {
+    PALETTE_FIRE,
+    PALETTE_ICE,
+    PALETTE_GRAY,
+    PALETTE_VIRIDIS,
+};
+
+const char *palette_names[] = {"fire", "ice", "gray", "viridis"};
+
+bool parse_palette(const char *name, Palette &palette){
+    for (int i = 0; i < int(sizeof(palette_names)/sizeof(palette_names[0])); i++){
+        if (strcmp(name, palette_names[i]) == 0){
+            palette = Palette(i);
+            return true;
+        }
+    }
+    printf("Unknown palette %s\n", name);
+    return false;
+}
+
+// color of a density of at least 0, the lookup table is sampled from this
+uint32_t palette_color(Palette palette, float density){
+    float f = log2f(density*0.25f + 1.0f);
+    float f3 = f*f*f;
+    switch (palette){
+        // black over red and yellow to white
+        case PALETTE_FIRE: return rgba(1.5f*f, 1.5f*f3, f3*f3, 1.0f);
+        // black over blue and cyan to white
+        case PALETTE_ICE: return rgba(f3*f3, 1.5f*f3, 1.5f*f, 1.0f);
+        case PALETTE_GRAY: return rgba(f, f, f, 1.0f);
+        case PALETTE_VIRIDIS: break;
+    }
+    // piecewise linear through five colors of matplotlib's viridis
+    static const float points[5][3] = {
+        {0.267f, 0.005f, 0.329f},
+        {0.229f, 0.322f, 0.546f},
+        {0.128f, 0.567f, 0.551f},
+        {0.369f, 0.789f, 0.383f},
+        {0.993f, 0.906f, 0.144f},
+    };
+    float t = clamp(f, 0.0f, 1.0f)*4.0f;
+    int i = std::min(int(t), 3);
+    float u = t - i;
+    return rgba(
+        lerp(points[i][0], points[i + 1][0], u),
+        lerp(points[i][1], points[i + 1][1], u),
+        lerp(points[i][2], points[i + 1][2], u),
+        1.0f);
+}
+
+// Turns the density into RGBA pixels through a lookup table of size colors
+// for densities in [0, max_density), so a pixel costs a multiply and a
+// gather instead of a logarithm and the clamps of rgba(). Densities past
+// the end get the last color. The image may have another size than the
+// grid, the density is then interpolated at the pixel centers.
+struct Colormap {
+    Palette palette;
+    float max_density;
+    // table[i] is the color of the middle of [i, i + 1)/scale
+    std::vector<uint32_t> table;
+    float scale;
+
+    Colormap(Palette palette = PALETTE_FIRE, float max_density = 4.0f, int size = 4096):
+        palette(palette),
+        max_density(max_density),
+        table(size),
+        scale(size/max_density)
+    {
+        for (int i = 0; i < size; i++){
+            table[i] = palette_color(palette, (i + 0.5f)/scale);
+        }
+    }
+
+    // width*height pixels, row 0 at the bottom like the density
+    template <typename T>
+    void apply(
+        const Grid<T> &density, uint32_t *pixels, int width, int height,
+        ThreadPool *pool = nullptr, const SimdKernels<T> *simd = get_simd_kernels<T>()
+    ) const {
+        parallel_for(pool, 0, height, [&](int y0, int y1){
+            simd->colormap(density, table.data(), table.size(), scale, pixels, width, height, y0, y1, 0, width);
+        });
+    }
+
+    // same size as the grid
+    template <typename T>
+    void apply(const Grid<T> &density, uint32_t *pixels, ThreadPool *pool = nullptr) const {
+        apply(density, pixels, density.nx, density.ny, pool);
+    }
+
+    // Same size as the grid, where the tiles not set in tiles hold no
+    // density and get the first color without being read.
+    template <typename T>
+    void apply(
+        const Grid<T> &density, uint32_t *pixels, const ActiveTiles &tiles,
+        ThreadPool *pool = nullptr, const SimdKernels<T> *simd = get_simd_kernels<T>()
+    ) const {
+        int nx = density.nx;
+        int ny = density.ny;
+        if (tiles.dense){
+            apply(density, pixels, nx, ny, pool, simd);
+            return;
+        }
+        parallel_for(pool, 0, tiles.size(), [&](int i0, int i1){
+            for (int i = i0; i < i1; i++){
+                int x0, x1, y0, y1;
+                tiles.bounds(i, x0, x1, y0, y1);
+                if (tiles.mask[i]){
+                    simd->colormap(density, table.data(), table.size(), scale, pixels, nx, ny, y0, y1, x0, x1);
+                    continue;
+                }
+                for (int y = y0; y < y1; y++){
+                    std::fill(pixels + size_t(y)*nx + x0, pixels + size_t(y)*nx + x1, table[0]);
+                }
+            }
+        }, 1);
+    }
+};
@@ -0,0 +1,91 @@
+#pragma once
+
+// Independent solvers of the same size stepped together, e.g. for a sweep
+// over their parameters, which are set on each member after construction.
+//
+// With at least as many members as threads, the members are split into one
+// run per thread, as in FluidSolver::jacobi_blocked(), and each thread steps
+// the members of its run serially, reusing one workspace for all of them.
+// Small grids then keep every core busy without the overhead of splitting
+// each pass into bands. With fewer members they step one after another,
+// each with the whole pool, and share the first workspace.
+//
+//     Ensemble ensemble(16, 128, 128, &pool);
+//     for (int i = 0; i < ensemble.size(); i++) ensemble[i].vorticity = i;
+//     for (int i = 0; i < 1000; i++) ensemble.step();
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include "fluid_solver.h"
+
+template <typename T>
+struct BasicEnsemble {
+    int nx, ny;
+    std::vector<std::unique_ptr<BasicFluidSolver<T>>> members;
+
+    ThreadPool *pool;
+    // set by the constructor, true if the members step in runs on separate
+    // threads, false if one at a time with the whole pool
+    bool across_members;
+    // one per run
+    std::vector<std::unique_ptr<Workspace>> workspaces;
+
+    BasicEnsemble(
+        int size, int nx, int ny,
+        ThreadPool *pool = nullptr,
+        float dt = 0.02f,
+        int iterations = 5,
+        float vorticity = 10.0f
+    ):
+        nx(nx), ny(ny),
+        pool(pool)
+    {
+        int threads = pool ? pool->size() : 1;
+        across_members = size >= threads;
+        int num_runs = across_members ? std::min(threads, size) : 1;
+        for (int i = 0; i < num_runs; i++) workspaces.emplace_back(new Workspace());
+        for (int run = 0; run < num_runs; run++){
+            for (int i = run*size/num_runs; i < (run + 1)*size/num_runs; i++){
+                BasicFluidSolver<T> *member = new BasicFluidSolver<T>(
+                    nx, ny, dt, iterations, vorticity, across_members ? nullptr : pool);
+                member->workspace = workspaces[run].get();
+                members.emplace_back(member);
+            }
+        }
+    }
+
+    int size() const {
+        return members.size();
+    }
+
+    BasicFluidSolver<T>& operator [] (int i){
+        return *members[i];
+    }
+
+    const BasicFluidSolver<T>& operator [] (int i) const {
+        return *members[i];
+    }
+
+    // cells of all members together
+    double cells() const {
+        return double(nx)*ny*size();
+    }
+
+    void step(){
+        PROFILE_SCOPE("ensemble_step");
+        int n = size();
+        if (!across_members){
+            for (int i = 0; i < n; i++) members[i]->step();
+            return;
+        }
+        int num_runs = workspaces.size();
+        parallel_for(pool, 0, num_runs, [&](int r0, int r1){
+            for (int run = r0; run < r1; run++){
+                for (int i = run*n/num_runs; i < (run + 1)*n/num_runs; i++) members[i]->step();
+            }
+        }, 1);
+    }
+};
+
+typedef BasicEnsemble<float> Ensemble;
@@ -0,0 +1,315 @@
+#pragma once
+
+#include <math.h>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "grid.h"
+#include "thread_pool.h"
+
+struct cpx {
+    float re, im;
+};
+
+cpx operator + (cpx a, cpx b){ return cpx{a.re + b.re, a.im + b.im}; }
+cpx operator - (cpx a, cpx b){ return cpx{a.re - b.re, a.im - b.im}; }
+cpx operator * (cpx a, cpx b){ return cpx{a.re*b.re - a.im*b.im, a.re*b.im + a.im*b.re}; }
+cpx operator * (float a, cpx b){ return cpx{a*b.re, a*b.im}; }
+cpx conj(cpx a){ return cpx{a.re, -a.im}; }
+// multiplication by -i
+cpx rotate(cpx a){ return cpx{a.im, -a.re}; }
+
+// Mixed radix Stockham FFT of one length. Radix 4 and 2 have their own
+// butterflies, any other prime factor uses a direct DFT of that size.
+struct FftPlan {
+    struct Stage {
+        int radix;
+        // number of butterflies per stride and stride
+        int m, s;
+        // twiddles[p*(radix - 1) + j - 1] = exp(-2 pi i p j/(radix m))
+        int twiddle_offset;
+    };
+
+    int n;
+    std::vector<Stage> stages;
+    std::vector<cpx> twiddles;
+    // roots[radix*j + k] = exp(-2 pi i j k/radix) for the generic radices
+    std::vector<std::vector<cpx>> roots;
+
+    FftPlan(int n): n(n){
+        int s = 1;
+        int rest = n;
+        while (rest > 1){
+            int radix = rest % 4 == 0 ? 4 : rest % 2 == 0 ? 2 : smallest_factor(rest);
+            int m = rest/radix;
+
+            Stage stage = {radix, m, s, (int)twiddles.size()};
+            stages.push_back(stage);
+
+            for (int p = 0; p < m; p++) for (int j = 1; j < radix; j++){
+                double angle = -2.0*M_PI*p*j/(radix*m);
+                twiddles.push_back(cpx{float(cos(angle)), float(sin(angle))});
+            }
+
+            if (radix != 2 && radix != 4){
+                if ((int)roots.size() <= radix) roots.resize(radix + 1);
+                if (roots[radix].empty()){
+                    for (int j = 0; j < radix; j++) for (int k = 0; k < radix; k++){
+                        double angle = -2.0*M_PI*((j*k) % radix)/radix;
+                        roots[radix].push_back(cpx{float(cos(angle)), float(sin(angle))});
+                    }
+                }
+            }
+
+            s *= radix;
+            rest = m;
+        }
+    }
+
+    static int smallest_factor(int n){
+        for (int f = 3; f*f <= n; f += 2){
+            if (n % f == 0) return f;
+        }
+        return n;
+    }
+
+    // one stage of the decimation in frequency Stockham algorithm, x -> y
+    void run_stage(const Stage &stage, const cpx *x, cpx *y) const {
+        int m = stage.m;
+        int s = stage.s;
+        const cpx *w = twiddles.data() + stage.twiddle_offset;
+
+        if (stage.radix == 2){
+            for (int p = 0; p < m; p++){
+                cpx w1 = w[p];
+                for (int q = 0; q < s; q++){
+                    cpx a = x[q + s*(p + 0*m)];
+                    cpx b = x[q + s*(p + 1*m)];
+                    y[q + s*(2*p + 0)] = a + b;
+                    y[q + s*(2*p + 1)] = (a - b)*w1;
+                }
+            }
+        } else if (stage.radix == 4){
+            for (int p = 0; p < m; p++){
+                cpx w1 = w[3*p + 0];
+                cpx w2 = w[3*p + 1];
+                cpx w3 = w[3*p + 2];
+                for (int q = 0; q < s; q++){
+                    cpx a = x[q + s*(p + 0*m)];
+                    cpx b = x[q + s*(p + 1*m)];
+                    cpx c = x[q + s*(p + 2*m)];
+                    cpx d = x[q + s*(p + 3*m)];
+                    cpx apc = a + c;
+                    cpx amc = a - c;
+                    cpx bpd = b + d;
+                    cpx jbmd = rotate(b - d);
+                    y[q + s*(4*p + 0)] = apc + bpd;
+                    y[q + s*(4*p + 1)] = (amc + jbmd)*w1;
+                    y[q + s*(4*p + 2)] = (apc - bpd)*w2;
+                    y[q + s*(4*p + 3)] = (amc - jbmd)*w3;
+                }
+            }
+        } else {
+            int radix = stage.radix;
+            const cpx *root = roots[radix].data();
+            thread_local std::vector<cpx> buffer;
+            if ((int)buffer.size() < radix) buffer.resize(radix);
+            cpx *in = buffer.data();
+            for (int p = 0; p < m; p++){
+                for (int q = 0; q < s; q++){
+                    for (int k = 0; k < radix; k++) in[k] = x[q + s*(p + k*m)];
+                    for (int j = 0; j < radix; j++){
+                        cpx sum = in[0];
+                        for (int k = 1; k < radix; k++) sum = sum + in[k]*root[radix*j + k];
+                        if (j > 0) sum = sum*w[p*(radix - 1) + j - 1];
+                        y[q + s*(radix*p + j)] = sum;
+                    }
+                }
+            }
+        }
+    }
+
+    // forward transform of data in place, scratch must hold n values
+    void forward(cpx *data, cpx *scratch) const {
+        cpx *x = data;
+        cpx *y = scratch;
+        for (const Stage &stage : stages){
+            run_stage(stage, x, y);
+            std::swap(x, y);
+        }
+        if (x != data){
+            for (int i = 0; i < n; i++) data[i] = x[i];
+        }
+    }
+
+    // unnormalized inverse transform
+    void inverse(cpx *data, cpx *scratch) const {
+        for (int i = 0; i < n; i++) data[i] = conj(data[i]);
+        forward(data, scratch);
+        for (int i = 0; i < n; i++) data[i] = conj(data[i]);
+    }
+};
+
+// Plans are shared by every user of the same length and never freed.
+const FftPlan& get_fft_plan(int n){
+    static std::mutex mutex;
+    static std::map<int, FftPlan*> plans;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    FftPlan *&plan = plans[n];
+    if (!plan) plan = new FftPlan(n);
+    return *plan;
+}
+
+// Eigenvalues of the periodic 5-point Laplacian for the spectra kept by
+// FftPoisson, shared between solvers of the same size.
+const std::vector<float>& get_poisson_inverse_eigenvalues(int nx, int ny){
+    static std::mutex mutex;
+    static std::map<std::pair<int, int>, std::vector<float>*> tables;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<float> *&table = tables[std::make_pair(nx, ny)];
+    if (!table){
+        int hx = nx/2 + 1;
+        table = new std::vector<float>(hx*ny);
+        for (int kx = 0; kx < hx; kx++) for (int ky = 0; ky < ny; ky++){
+            double lambda = 2.0*cos(2.0*M_PI*kx/nx) + 2.0*cos(2.0*M_PI*ky/ny) - 4.0;
+            // the mean of p is free, keep it at zero
+            (*table)[ky + kx*ny] = kx == 0 && ky == 0 ? 0.0f : float(1.0/(lambda*nx*ny));
+        }
+    }
+    return *table;
+}
+
+// Exact solution of the periodic pressure equation
+//
+//     p(x+1, y) + p(x-1, y) + p(x, y+1) + p(x, y-1) - 4 p(x, y) = f(x, y)
+//
+// Real rows are transformed two at a time as one complex row, only the
+// nx/2 + 1 non-redundant columns are kept, transposed in cache blocks so
+// the column transforms also run on contiguous rows, divided by the
+// eigenvalues of the Laplacian and transformed back.
+struct FftPoisson {
+    int nx, ny, hx;
+    const FftPlan &plan_x;
+    const FftPlan &plan_y;
+    const std::vector<float> &inverse_eigenvalues;
+
+    // ny rows of hx values and hx rows of ny values
+    std::vector<cpx> rows;
+    std::vector<cpx> columns;
+
+    ThreadPool *pool = nullptr;
+
+    FftPoisson(int nx, int ny):
+        nx(nx), ny(ny), hx(nx/2 + 1),
+        plan_x(get_fft_plan(nx)),
+        plan_y(get_fft_plan(ny)),
+        inverse_eigenvalues(get_poisson_inverse_eigenvalues(nx, ny)),
+        rows(hx*ny),
+        columns(hx*ny)
+    {}
+
+    static cpx* scratch(int n){
+        thread_local std::vector<cpx> buffer;
+        if ((int)buffer.size() < n) buffer.resize(n);
+        return buffer.data();
+    }
+
+    // real to complex transform of rows y and y + 1 of f into rows
+    void forward_rows(const Grid<float> &f, int y0, int y1){
+        cpx *z = scratch(2*nx);
+        cpx *tmp = z + nx;
+        for (int y = y0; y < y1; y += 2){
+            const float *a = f.row(y);
+            const float *b = y + 1 < y1 ? f.row(y + 1) : nullptr;
+            for (int x = 0; x < nx; x++) z[x] = cpx{a[x], b ? b[x] : 0.0f};
+
+            plan_x.forward(z, tmp);
+
+            cpx *ra = &rows[y*hx];
+            cpx *rb = b ? ra + hx : nullptr;
+            for (int k = 0; k < hx; k++){
+                cpx zk = z[k];
+                cpx zn = conj(z[(nx - k) % nx]);
+                ra[k] = 0.5f*(zk + zn);
+                if (rb) rb[k] = rotate(0.5f*(zk - zn));
+            }
+        }
+    }
+
+    // complex to real transform of rows y and y + 1 into p
+    void inverse_rows(Grid<float> &p, int y0, int y1){
+        cpx *z = scratch(2*nx);
+        cpx *tmp = z + nx;
+        for (int y = y0; y < y1; y += 2){
+            const cpx *ra = &rows[y*hx];
+            const cpx *rb = y + 1 < y1 ? ra + hx : nullptr;
+            for (int k = 0; k < nx; k++){
+                bool mirrored = k >= hx;
+                int i = mirrored ? nx - k : k;
+                cpx a = mirrored ? conj(ra[i]) : ra[i];
+                cpx b = rb ? (mirrored ? conj(rb[i]) : rb[i]) : cpx{0.0f, 0.0f};
+                // a + i b
+                z[k] = cpx{a.re - b.im, a.im + b.re};
+            }
+
+            plan_x.inverse(z, tmp);
+
+            float *a = p.row(y);
+            float *b = rb ? p.row(y + 1) : nullptr;
+            for (int x = 0; x < nx; x++){
+                a[x] = z[x].re;
+                if (b) b[x] = z[x].im;
+            }
+        }
+    }
+
+    // dst[c*n_rows + r] = src[r*n_columns + c] in blocks which fit in L1
+    void transpose(const cpx *src, cpx *dst, int n_rows, int n_columns){
+        const int block = 32;
+        int n_blocks = (n_rows + block - 1)/block;
+        parallel_for(pool, 0, n_blocks, [&](int b0, int b1){
+            for (int r0 = b0*block; r0 < std::min(b1*block, n_rows); r0 += block)
+            for (int c0 = 0; c0 < n_columns; c0 += block){
+                int r1 = std::min(r0 + block, n_rows);
+                int c1 = std::min(c0 + block, n_columns);
+                for (int r = r0; r < r1; r++) for (int c = c0; c < c1; c++){
+                    dst[c*n_rows + r] = src[r*n_columns + c];
+                }
+            }
+        });
+    }
+
+    void solve(Grid<float> &p, const Grid<float> &f){
+        // keep row pairs in one band
+        int pairs = (ny + 1)/2;
+
+        parallel_for(pool, 0, pairs, [&](int i0, int i1){
+            forward_rows(f, 2*i0, std::min(2*i1, ny));
+        });
+
+        transpose(rows.data(), columns.data(), ny, hx);
+
+        parallel_for(pool, 0, hx, [&](int k0, int k1){
+            cpx *tmp = scratch(ny);
+            for (int kx = k0; kx < k1; kx++){
+                cpx *column = &columns[kx*ny];
+                const float *inverse_eigenvalue = &inverse_eigenvalues[kx*ny];
+                plan_y.forward(column, tmp);
+                for (int ky = 0; ky < ny; ky++){
+                    column[ky] = inverse_eigenvalue[ky]*column[ky];
+                }
+                plan_y.inverse(column, tmp);
+            }
+        });
+
+        transpose(columns.data(), rows.data(), hx, ny);
+
+        parallel_for(pool, 0, pairs, [&](int i0, int i1){
+            inverse_rows(p, 2*i0, std::min(2*i1, ny));
+        });
+        p.fill_halo();
+    }
+};
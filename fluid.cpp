@@ -3,28 +3,22 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include "vec2.h"
-
-#ifdef _WIN32
-#include <windows.h>
-
-double sec(){
-    LARGE_INTEGER frequency, t;
-    QueryPerformanceCounter(&t);
-    QueryPerformanceFrequency(&frequency);
-    return t.QuadPart / (double)frequency.QuadPart;
-}
-#else
-#include <time.h>
-
-double sec(){
-    struct timespec t;
-    clock_gettime(CLOCK_MONOTONIC, &t);
-    return t.tv_sec + 1e-9*t.tv_nsec;
-}
-#endif
+#include "fluid_solver.h"
+#include "colormap.h"
+#include "profiler.h"
+#include "frame_writer.h"
+#include "triple_buffer.h"
+#include "sim_clock.h"
+#include "shared_fields.h"
 
 int w = 512;
 int h = 512;
@@ -32,11 +26,89 @@ int h = 512;
 const int nx = 256;
 const int ny = 256;
 
-float dt = 0.02f;
-int iterations = 5;
-float vorticity = 10.0f;
+// The solver runs on its own thread and publishes the density after each
+// step, the GLUT thread colors and draws the latest one it finds. Neither
+// waits for the other, so a frame takes the longer of the two instead of
+// their sum. The pool belongs to the simulation thread.
+ThreadPool pool;
+FluidSolver solver(nx, ny, 0.02f, 5, 10.0f, &pool);
+
+struct SimulationFrame {
+    // with the halo, for interpolating at another texture size
+    Grid<float> density;
+    // outside of these the density is zero
+    ActiveTiles tiles;
+    double timings[4] = {0.0, 0.0, 0.0, 0.0};
+    double simulated_seconds = 0.0;
+    // real time the solver could not keep up with
+    double dropped_seconds = 0.0;
+
+    SimulationFrame(int nx, int ny): density(nx, ny), tiles(nx, ny){
+        density.fill(0.0f);
+    }
+};
 
-vec2f mouse;
+TripleBuffer<SimulationFrame> frames(nx, ny);
+
+// mouse input for the simulation thread, taken before each step
+std::mutex input_mutex;
+vec2f input_mouse = {0.0f, 0.0f};
+std::vector<vec2f> input_clicks;
+
+std::thread simulation_thread;
+std::atomic<bool> stop_simulation{false};
+
+// Simulated time follows real time: the solver runs as many steps of dt as
+// have come due since it last woke up, up to the clock's max_steps, and
+// then sleeps until the next one. A slow step is made up for by the steps
+// after it instead of slowing the simulation down.
+FixedStepClock sim_clock;
+
+// with --publish, every step goes to shared memory for other processes
+SharedFieldsWriter shared_fields;
+
+void simulation_loop(){
+    using clock = std::chrono::steady_clock;
+    clock::time_point last = clock::now();
+    std::vector<vec2f> clicks;
+    while (!stop_simulation.load(std::memory_order_relaxed)){
+        clock::time_point now = clock::now();
+        sim_clock.advance(std::chrono::duration<double>(now - last).count());
+        last = now;
+
+        {
+            std::lock_guard<std::mutex> lock(input_mutex);
+            solver.mouse = input_mouse;
+            clicks.swap(input_clicks);
+        }
+        for (vec2f p : clicks) solver.add_density(p.x, p.y, 10, 300.0f);
+        clicks.clear();
+
+        bool stepped = false;
+        while (sim_clock.step_due(solver.dt)){
+            solver.step();
+            shared_fields.publish(solver.frame, solver.old_density, solver.old_u, solver.old_v);
+            stepped = true;
+        }
+
+        if (stepped){
+            SimulationFrame &frame = frames.write_buffer();
+            memcpy(frame.density.memory, solver.density().memory, Grid<float>::storage_size(nx, ny));
+            frame.tiles = solver.density_tiles;
+            for (int i = 0; i < 4; i++) frame.timings[i] = solver.timings[i];
+            frame.simulated_seconds = sim_clock.simulated_seconds;
+            frame.dropped_seconds = sim_clock.dropped_seconds;
+            frames.publish();
+        }
+
+        std::this_thread::sleep_for(std::chrono::duration<double>(sim_clock.wait(solver.dt)));
+    }
+}
+
+void join_simulation(){
+    stop_simulation = true;
+    if (simulation_thread.joinable()) simulation_thread.join();
+}
 
 void draw(const vec2f *data, int n, GLenum mode){
     glEnableClientState(GL_VERTEX_ARRAY);
@@ -53,64 +125,17 @@ void draw_circle(float x, float y, float r, int n = 100){
     draw(pos, n, GL_LINE_LOOP);
 }
 
-template <typename T>
-struct Grid {
-    T *values;
-    int nx, ny;
-
-    Grid(int nx, int ny): nx(nx), ny(ny){
-        values = new T[nx*ny];
-    }
-
-    Grid(const Grid&) = delete;
-    Grid& operator = (const Grid&) = delete;
-
-    ~Grid(){
-        delete[] values;
-    }
-
-    void swap(Grid &other){
-        std::swap(values, other.values);
-        std::swap(nx, other.nx);
-        std::swap(ny, other.ny);
-    }
-
-    const T* data() const {
-        return values;
-    }
-
-    int idx(int x, int y) const {
-        //x = clamp(x, 0, nx - 1);
-        //y = clamp(y, 0, ny - 1);
-
-        // wrap around
-        x = (x + nx) % nx;
-        y = (y + ny) % ny;
-
-        return x + y*nx;
-    }
-
-    T& operator () (int x, int y){
-        return values[idx(x, y)];
-    }
-
-    const T& operator () (int x, int y) const {
-        return values[idx(x, y)];
-    }
-};
-
-Grid<vec2f> old_velocity(nx, ny);
-Grid<vec2f> new_velocity(nx, ny);
-
-Grid<float> old_density(nx, ny);
-Grid<float> new_density(nx, ny);
-
-Grid<uint32_t> pixels(nx, ny);
+// the density is drawn into a texture of this size, --texture WxH
+int texture_w = nx;
+int texture_h = ny;
+std::vector<uint32_t> pixels;
+Colormap colors;
+// The colormap's own, a pool takes work from one thread only and the other
+// belongs to the solver. Half the cores, the solver runs meanwhile.
+ThreadPool render_pool(std::max(ThreadPool::default_threads(0)/2, 1));
 
 GLuint texture;
 
-#define FOR_EACH_CELL for (int y = 0; y < ny; y++) for (int x = 0; x < nx; x++)
-
 void check_gl(int line){
     int error = glGetError();
     if (error != GL_NO_ERROR){
@@ -121,11 +146,6 @@ void check_gl(int line){
 #define CHECK_GL check_gl(__LINE__);
 
 void init(){
-    FOR_EACH_CELL {
-        old_density(x, y) = 0.0f;
-        old_velocity(x, y) = vec2f{0.0f, 0.0f};
-    }
-
     glEnable(GL_TEXTURE_2D);
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
@@ -136,229 +156,15 @@ void init(){
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, nx, ny, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-}
-
-template <typename T>
-T interpolate(const Grid<T> &grid, vec2f p){
-    int ix = floorf(p.x);
-    int iy = floorf(p.y);
-    float ux = p.x - ix;
-    float uy = p.y - iy;
-    return lerp(
-        lerp(grid(ix + 0, iy + 0), grid(ix + 1, iy + 0), ux),
-        lerp(grid(ix + 0, iy + 1), grid(ix + 1, iy + 1), ux),
-        uy
-    );
-}
-
-void advect_density(){
-    FOR_EACH_CELL {
-        vec2f pos = v2f(x, y) - dt*old_velocity(x, y);
-        new_density(x, y) =  interpolate(old_density, pos);
-    }
-    old_density.swap(new_density);
-}
-
-void advect_velocity(){
-    FOR_EACH_CELL {
-        vec2f pos = v2f(x, y) - dt*old_velocity(x, y);
-        new_velocity(x, y) =  interpolate(old_velocity, pos);
-    }
-    old_velocity.swap(new_velocity);
-}
-
-void diffuse_density(){
-    float diffusion = dt*100.01f;
-    FOR_EACH_CELL {
-        float sum =
-            diffusion*(
-            + old_density(x - 1, y + 0)
-            + old_density(x + 1, y + 0)
-            + old_density(x + 0, y - 1)
-            + old_density(x + 0, y + 1)
-            )
-            + old_density(x + 0, y + 0);
-        new_density(x, y) = 1.0f/(1.0f + 4.0f*diffusion) * sum;
-    }
-    old_density.swap(new_density);
-}
-
-void diffuse_velocity(){
-    float viscosity = dt*0.000001f;
-    FOR_EACH_CELL {
-        vec2f sum =
-            viscosity*(
-            + old_velocity(x - 1, y + 0)
-            + old_velocity(x + 1, y + 0)
-            + old_velocity(x + 0, y - 1)
-            + old_velocity(x + 0, y + 1)
-            )
-            + old_velocity(x + 0, y + 0);
-        new_velocity(x, y) = 1.0f/(1.0f + 4.0f*viscosity) * sum;
-    }
-    old_velocity.swap(new_velocity);
-}
-
-void project_velocity(){
-    Grid<float> p(nx, ny);
-    Grid<float> p2(nx, ny);
-    Grid<float> div(nx, ny);
-
-    FOR_EACH_CELL {
-        float dx = old_velocity(x + 1, y + 0).x - old_velocity(x - 1, y + 0).x;
-        float dy = old_velocity(x + 0, y + 1).y - old_velocity(x + 0, y - 1).y;
-        div(x, y) = dx + dy;
-        p(x, y) = 0.0f;
-    }
-
-    for (int k = 0; k < iterations; k++){
-        FOR_EACH_CELL {
-            float sum = -div(x, y)
-                + p(x + 1, y + 0)
-                + p(x - 1, y + 0)
-                + p(x + 0, y + 1)
-                + p(x + 0, y - 1);
-            p2(x, y) = 0.25f*sum;
-        }
-        p.swap(p2);
-    }
-
-    FOR_EACH_CELL {
-        old_velocity(x, y).x -= 0.5f*(p(x + 1, y + 0) - p(x - 1, y + 0));
-        old_velocity(x, y).y -= 0.5f*(p(x + 0, y + 1) - p(x + 0, y - 1));
-    }
-}
-
-float curl(int x, int y){
-    return
-        old_velocity(x, y + 1).x - old_velocity(x, y - 1).x +
-        old_velocity(x - 1, y).y - old_velocity(x + 1, y).y;
-}
-
-void vorticity_confinement(){
-    Grid<float> abs_curl(nx, ny);
-
-    FOR_EACH_CELL {
-        abs_curl(x, y) = fabsf(curl(x, y));
-    }
-
-    FOR_EACH_CELL {
-        vec2f direction;
-        direction.x = abs_curl(x + 0, y - 1) - abs_curl(x + 0, y + 1);
-        direction.y = abs_curl(x + 1, y + 0) - abs_curl(x - 1, y + 0);
-
-        direction = vorticity/(length(direction) + 1e-5f) * direction;
-
-        if (x < nx/2) direction *= 0.0f;
-
-        new_velocity(x, y) = old_velocity(x, y) + dt*curl(x, y)*direction;
-    }
-
-    old_velocity.swap(new_velocity);
-}
-
-void add_density(int px, int py, int r = 10, float value = 0.5f){
-    for (int y = -r; y <= r; y++) for (int x = -r; x <= r; x++){
-        float d = sqrtf(x*x + y*y);
-        float u = smoothstep(float(r), 0.0f, d);
-        old_density(px + x, py + y) += u*value;
-    }
-}
-
-float randf(float a, float b){
-    float u = rand()*(1.0f/RAND_MAX);
-    return lerp(a, b, u);
-}
-
-float sign(float x){
-    return
-        x > 0.0f ? +1.0f :
-        x < 0.0f ? -1.0f :
-        0.0f;
-}
-
-void fluid_simulation_step(){
-    FOR_EACH_CELL {
-        if (x > nx*0.5f) continue;
-
-        float r = 10.0f;
-        old_velocity(x, y).x += randf(-r, +r);
-        old_velocity(x, y).y += randf(-r, +r);
-    }
-
-    // dense regions rise up
-    FOR_EACH_CELL {
-        old_velocity(x, y).y += (old_density(x, y)*20.0f - 5.0f)*dt;
-    }
-
-    add_density(mouse.x, mouse.y, 10, 0.5f);
-
-    // fast movement is dampened
-    FOR_EACH_CELL {
-        old_velocity(x, y) *= 0.999f;
-    }
-
-    // fade away
-    FOR_EACH_CELL {
-        old_density(x, y) *= 0.99f;
-    }
-
-    add_density(nx*0.25f, 30);
-    add_density(nx*0.75f, 30);
-
-    double t[10];
-
-    t[0] = sec();
-    vorticity_confinement();
-    t[1] = sec();
-    //diffuse_velocity();
-    //project_velocity();
-    advect_velocity();
-    t[2] = sec();
-    project_velocity();
-    t[3] = sec();
-
-    //diffuse_density();
-    advect_density();
-    t[4] = sec();
-
-    // zero out stuff at bottom
-    FOR_EACH_CELL {
-        if (y < 10){
-            old_density(x, y) = 0.0f;
-            old_velocity(x, y) = vec2f{0.0f, 0.0f};
-        }
-    }
-
-    for (int i = 0; i < 4; i++){
-        t[i] = (t[i + 1] - t[i])*1000;
-    }
-
-    char title[256];
-    snprintf(title, sizeof(title), "%f %f %f %f\n", t[0], t[1], t[2], t[3]);
-    glutSetWindowTitle(title);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, texture_w, texture_h, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    pixels.resize(texture_w*texture_h);
 }
 
-void screenshot(const char *path){
-    std::vector<uint32_t> rgba(w*h);
-    std::vector<uint8_t> rgb(w*h*3);
-
-    glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, rgba.data());
-
-    int i = 0;
-    for (int y = h - 1; y >= 0; y--) for (int x = 0; x < w; x++){
-        uint32_t c = rgba[x + y*w];
-        rgb[i++] = (c >> 0*8) & 255;
-        rgb[i++] = (c >> 1*8) & 255;
-        rgb[i++] = (c >> 2*8) & 255;
-    }
+FrameWriter writer;
 
-    FILE *fp = fopen(path, "wb");
-    assert(fp);
-    fprintf(fp, "P6\n%i %i\n255\n", w, h);
-    fwrite(rgb.data(), 1, rgb.size(), fp);
-    fclose(fp);
+void close_writer(){
+    writer.close();
+    if (writer.frames_submitted + writer.frames_dropped > 0) writer.print_stats(stdout);
 }
 
 uint32_t swap_bytes(uint32_t x, int i, int j){
@@ -371,44 +177,38 @@ uint32_t swap_bytes(uint32_t x, int i, int j){
     return u.x;
 }
 
-uint32_t rgba32(uint32_t r, uint32_t g, uint32_t b, uint32_t a){
-    r = clamp(r, 0u, 255u);
-    g = clamp(g, 0u, 255u);
-    b = clamp(b, 0u, 255u);
-    a = clamp(a, 0u, 255u);
-    return (a << 24) | (b << 16) | (g << 8) | r;
-}
-
-uint32_t rgba(float r, float g, float b, float a){
-    return rgba32(r*256, g*256, b*256, a*256);
-}
-
 void on_frame(){
+    PROFILE_SCOPE("frame");
     CHECK_GL
     glClearColor(0.1f, 0.2f, 0.3f, 0.0f);
     glClear(GL_COLOR_BUFFER_BIT);
 
-    fluid_simulation_step();
-
-    double t = sec();
-    // density field to pixels
-    FOR_EACH_CELL {
-        float f = old_density(x, y);
-        f = log2f(f*0.25f + 1.0f);
-        float f3 = f*f*f;
-        float r = 1.5f*f;
-        float g = 1.5f*f3;
-        float b = f3*f3;
-        pixels(x, y) = rgba(r, g, b, 1.0);
-    }
-    double dt = sec() - t;
-    printf("%f\n", dt*1000);
+    // the texture keeps the last frame if the simulation has no new one
+    if (frames.update()){
+        const SimulationFrame &frame = frames.read_buffer();
+        const double *t = frame.timings;
+        char title[256];
+        snprintf(title, sizeof(title), "%f %f %f %f, %.1f s simulated, %.1f s dropped\n",
+            t[0], t[1], t[2], t[3], frame.simulated_seconds, frame.dropped_seconds);
+        glutSetWindowTitle(title);
+
+        {
+            PROFILE_SCOPE("colormap");
+            if (texture_w == nx && texture_h == ny){
+                colors.apply(frame.density, pixels.data(), frame.tiles, &render_pool);
+            } else {
+                colors.apply(frame.density, pixels.data(), texture_w, texture_h, &render_pool);
+            }
+        }
 
-    // upload pixels to texture
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, nx, ny, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+        // upload pixels to texture
+        PROFILE_SCOPE("upload");
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, texture_w, texture_h, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+    }
 
     // draw texture
+    PROFILE_SCOPE("draw");
     glBegin(GL_QUADS);
     glTexCoord2f(0.0f, 0.0f); glVertex2f(-1.0f, -1.0f);
     glTexCoord2f(1.0f, 0.0f); glVertex2f(+1.0f, -1.0f);
@@ -416,19 +216,13 @@ void on_frame(){
     glTexCoord2f(0.0f, 1.0f); glVertex2f(-1.0f, +1.0f);
     glEnd();
 
-#if 0
-    // To make video from frames:
-    // ffmpeg -i frame_%d.ppm video.mp4
-    static int frame = 0;
-    char path[256];
-    snprintf(path, sizeof(path), "frames/frame_%d.ppm", frame);
-    screenshot(path);
-    puts(path);
-    frame++;
-    if (frame >= 1024){
-        exit(0);
+    if (writer.is_open()){
+        PROFILE_SCOPE("record");
+        if (uint32_t *frame = writer.acquire()){
+            glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, frame);
+            writer.submit();
+        }
     }
-#endif
     glutSwapBuffers();
     CHECK_GL
 }
@@ -440,7 +234,8 @@ void work(int frame){
 
 void on_move(int x, int y){
     y = h - 1 - y;
-    mouse = vec2f{x*1.0f*nx/w, y*1.0f*ny/h};
+    std::lock_guard<std::mutex> lock(input_mutex);
+    input_mouse = vec2f{x*1.0f*nx/w, y*1.0f*ny/h};
 }
 
 void on_mouse_button(int button, int action, int x, int y){
@@ -450,7 +245,8 @@ void on_mouse_button(int button, int action, int x, int y){
 
     if (button == GLUT_LEFT_BUTTON){
         if (down){
-            add_density(mouse.x, mouse.y, 10, 300.0f);
+            std::lock_guard<std::mutex> lock(input_mutex);
+            input_clicks.push_back(input_mouse);
         }
     }
 }
@@ -461,8 +257,44 @@ int main(int argc, char **argv){
     glutInitWindowSize(w, h);
     glutCreateWindow("");
 
+    // ./fluid --record video.y4m [--drop-frames], or --record "|ffmpeg -i - video.mp4"
+    // ./fluid --palette fire|ice|gray|viridis --texture 512x512
+    // ./fluid --cfl 1 for a time step adapted to the velocity, at most 0.02
+    // ./fluid --sparse to skip the tiles without density
+    // ./fluid --publish /fluid to share the fields, see shared_fields.h
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "--record") == 0 && i + 1 < argc){
+            if (!writer.open(argv[++i], w, h)) return 1;
+        } else if (strcmp(argv[i], "--drop-frames") == 0){
+            writer.drop_when_full = true;
+        } else if (strcmp(argv[i], "--palette") == 0 && i + 1 < argc){
+            Palette palette;
+            if (!parse_palette(argv[++i], palette)) return 1;
+            colors = Colormap(palette);
+        } else if (strcmp(argv[i], "--sparse") == 0){
+            solver.sparse = true;
+        } else if (strcmp(argv[i], "--publish") == 0 && i + 1 < argc){
+            if (!shared_fields.open(argv[++i], nx, ny)) return 1;
+        } else if (strcmp(argv[i], "--cfl") == 0 && i + 1 < argc){
+            solver.cfl = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--texture") == 0 && i + 1 < argc){
+            if (sscanf(argv[++i], "%ix%i", &texture_w, &texture_h) != 2 || texture_w < 1 || texture_h < 1){
+                printf("Invalid texture size %s\n", argv[i]);
+                return 1;
+            }
+        }
+    }
+    atexit(close_writer);
+
     init();
 
+    // with -DFLUID_PROFILE
+    profiler_report_on_exit("fluid_trace.json");
+
+    // stopped first on exit, before the report and the writer
+    simulation_thread = std::thread(simulation_loop);
+    atexit(join_simulation);
+
     glutMouseFunc(on_mouse_button);
     glutMotionFunc(on_move);
     glutPassiveMotionFunc(on_move);
@@ -0,0 +1,193 @@
+// Writes every Nth frame of a run to a compressed archive and reads it back,
+// reporting the compression ratio, compression and decompression speed,
+// random access time and the largest error against the original fields.
+//
+// Build:
+//     g++ -O3 -march=native -pthread fluid_archive.cpp -o fluid_archive
+//
+// Example:
+//     ./fluid_archive --nx 1024 --ny 1024 --steps 400 --every 4
+//     ./fluid_archive --quantum 0          # lossless
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include "fluid_solver.h"
+#include "archive.h"
+
+struct Options {
+    int nx = 256;
+    int ny = 256;
+    int steps = 400;
+    int warmup = 10;
+    int every = 4;
+    float quantum = 1e-3f;
+    int keyframes = 32;
+    int threads = 0;
+    int random_reads = 100;
+    const char *path = "fluid.arc";
+    bool keep = false;
+};
+
+void usage(const char *name){
+    printf("Usage: %s [options]\n", name);
+    printf("    --nx N            grid width (default 256)\n");
+    printf("    --ny N            grid height (default 256)\n");
+    printf("    --steps N         number of steps (default 400)\n");
+    printf("    --warmup N        steps before the first frame (default 10)\n");
+    printf("    --every N         steps from one archived frame to the next (default 4)\n");
+    printf("    --quantum F       quantization step, 0 for lossless (default 0.001)\n");
+    printf("    --keyframes N     frames from one keyframe to the next (default 32)\n");
+    printf("    --threads N       worker threads, 0 for all cores (default 0)\n");
+    printf("    --random N        frames read in random order (default 100)\n");
+    printf("    --path PATH       archive file (default fluid.arc)\n");
+    printf("    --keep            keep the archive file\n");
+}
+
+bool parse_options(Options &options, int argc, char **argv){
+    for (int i = 1; i < argc; i++){
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) return false;
+
+        if (strcmp(arg, "--keep") == 0){
+            options.keep = true;
+            continue;
+        }
+
+        if (!value){
+            printf("Missing value for %s\n", arg);
+            return false;
+        }
+
+        if      (strcmp(arg, "--nx"       ) == 0) options.nx           = atoi(value);
+        else if (strcmp(arg, "--ny"       ) == 0) options.ny           = atoi(value);
+        else if (strcmp(arg, "--steps"    ) == 0) options.steps        = atoi(value);
+        else if (strcmp(arg, "--warmup"   ) == 0) options.warmup       = atoi(value);
+        else if (strcmp(arg, "--every"    ) == 0) options.every        = atoi(value);
+        else if (strcmp(arg, "--quantum"  ) == 0) options.quantum      = atof(value);
+        else if (strcmp(arg, "--keyframes") == 0) options.keyframes    = atoi(value);
+        else if (strcmp(arg, "--threads"  ) == 0) options.threads      = atoi(value);
+        else if (strcmp(arg, "--random"   ) == 0) options.random_reads = atoi(value);
+        else if (strcmp(arg, "--path"     ) == 0) options.path         = value;
+        else {
+            printf("Unknown option %s\n", arg);
+            return false;
+        }
+        i++;
+    }
+
+    if (options.nx < 1 || options.ny < 1 || options.every < 1 || options.quantum < 0.0f){
+        printf("Invalid options\n");
+        return false;
+    }
+
+    return true;
+}
+
+const int CHANNELS = 3;
+const char *channel_names[CHANNELS] = {"density", "u", "v"};
+
+int main(int argc, char **argv){
+    Options options;
+    if (!parse_options(options, argc, argv)){
+        usage(argv[0]);
+        return 1;
+    }
+
+    int nx = options.nx;
+    int ny = options.ny;
+    size_t n = size_t(nx)*ny;
+
+    ThreadPool pool(options.threads);
+    FluidSolver solver(nx, ny, 0.02f, 5, 10.0f, &pool);
+    for (int i = 0; i < options.warmup; i++) solver.step();
+
+    ArchiveWriter writer;
+    if (!writer.open(options.path, nx, ny, CHANNELS, options.quantum, options.keyframes)) return 1;
+
+    // the original fields, to measure the error of what is read back
+    int frames = (options.steps + options.every - 1)/options.every;
+    bool verify = frames*n*CHANNELS*sizeof(float) <= (size_t(1) << 30);
+    std::vector<float> originals;
+    if (verify) originals.reserve(frames*n*CHANNELS);
+
+    double step_time = 0.0;
+    double t = sec();
+    for (int i = 0; i < options.steps; i++){
+        double ts = sec();
+        solver.step();
+        step_time += sec() - ts;
+        if (i % options.every) continue;
+
+        const Grid<float> *fields[CHANNELS] = {&solver.old_density, &solver.old_u, &solver.old_v};
+        writer.submit(solver.frame, fields);
+        if (verify){
+            for (const Grid<float> *field : fields){
+                for (int y = 0; y < ny; y++){
+                    originals.insert(originals.end(), field->row(y), field->row(y) + nx);
+                }
+            }
+        }
+    }
+    double elapsed = sec() - t;
+    if (!writer.close()) return 1;
+
+    printf("grid             %i x %i, %i steps, every %i archived\n", nx, ny, options.steps, options.every);
+    if (options.quantum > 0.0f){
+        printf("quantum          %g\n", options.quantum);
+    } else {
+        printf("quantum          lossless\n");
+    }
+    printf("steps/sec        %f (%f without archiving)\n", options.steps/elapsed, options.steps/step_time);
+    writer.print_stats(stdout);
+
+    ArchiveReader reader;
+    if (!reader.open(options.path)) return 1;
+
+    Grid<float> density(nx, ny), u(nx, ny), v(nx, ny);
+    Grid<float> *fields[CHANNELS] = {&density, &u, &v};
+
+    double max_error[CHANNELS] = {};
+    double sequential = 0.0;
+    for (long k = 0; k < reader.size(); k++){
+        t = sec();
+        if (!reader.read(k, fields)){
+            printf("Could not read frame %li\n", k);
+            return 1;
+        }
+        sequential += sec() - t;
+        if (!verify) continue;
+        for (int c = 0; c < CHANNELS; c++){
+            const float *original = originals.data() + (k*CHANNELS + c)*n;
+            for (int y = 0; y < ny; y++) for (int x = 0; x < nx; x++){
+                double error = fabs(double((*fields[c])(x, y)) - original[x + y*nx]);
+                max_error[c] = std::max(max_error[c], error);
+            }
+        }
+    }
+    printf("sequential read  %.1f MB/s\n", writer.raw_bytes*1e-6/sequential);
+
+    if (options.random_reads > 0 && reader.size() > 0){
+        srand(1);
+        t = sec();
+        for (int i = 0; i < options.random_reads; i++){
+            reader.read(rand() % reader.size(), fields);
+        }
+        double random = sec() - t;
+        printf("random read      %f ms per frame\n", random*1000/options.random_reads);
+    }
+
+    if (verify){
+        for (int c = 0; c < CHANNELS; c++){
+            printf("max error        %-8s %e\n", channel_names[c], max_error[c]);
+        }
+    }
+
+    if (!options.keep) remove(options.path);
+    return 0;
+}
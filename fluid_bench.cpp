@@ -0,0 +1,419 @@
+// Times each pass of the CPU fluid solver and whole steps across grid sizes
+// and thread counts, optionally writes the results as JSON and compares
+// them against a saved baseline.
+//
+// Build:
+//     g++ -O3 -march=native -pthread fluid_bench.cpp -o fluid_bench
+//
+// Example:
+//     ./fluid_bench --sizes 256,1024 --threads 1,0 --json baseline.json
+//     ./fluid_bench --sizes 256,1024 --threads 1,0 --baseline baseline.json
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "fluid_solver.h"
+#include "colormap.h"
+
+struct Options {
+    std::vector<int> sizes = {256, 512, 1024};
+    std::vector<int> threads = {1, 0};
+    int settle = 20;
+    int warmup = 5;
+    int reps = 30;
+    PressureMethod pressure = PRESSURE_JACOBI;
+    SimdLevel simd = best_simd_level();
+    const char *json = nullptr;
+    const char *baseline = nullptr;
+    // relative slowdown of the median which counts as a regression
+    double threshold = 0.10;
+};
+
+void usage(const char *name){
+    printf("Usage: %s [options]\n", name);
+    printf("    --sizes N,N,...   square grid sizes (default 256,512,1024)\n");
+    printf("    --threads N,N,... thread counts, 0 for all cores (default 1,0)\n");
+    printf("    --settle N        untimed steps before the first kernel (default 20)\n");
+    printf("    --warmup N        untimed runs of each kernel (default 5)\n");
+    printf("    --reps N          timed runs of each kernel (default 30)\n");
+    printf("    --pressure NAME   pressure solver: jacobi, sor, multigrid, fft (default jacobi)\n");
+    printf("    --simd NAME       kernels: scalar, sse, avx2, avx512 (default widest supported)\n");
+    printf("    --json PATH       write the results to PATH\n");
+    printf("    --baseline PATH   compare the medians against results written by --json\n");
+    printf("    --threshold F     relative slowdown reported as a regression (default 0.10)\n");
+}
+
+bool parse_list(const char *value, std::vector<int> &list){
+    list.clear();
+    while (*value){
+        char *end;
+        long n = strtol(value, &end, 10);
+        if (end == value || n < 0) return false;
+        list.push_back(n);
+        value = *end == ',' ? end + 1 : end;
+        if (*end && *end != ',') return false;
+    }
+    return !list.empty();
+}
+
+bool parse_options(Options &options, int argc, char **argv){
+    for (int i = 1; i < argc; i++){
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) return false;
+
+        if (!value){
+            printf("Missing value for %s\n", arg);
+            return false;
+        }
+
+        if      (strcmp(arg, "--settle"   ) == 0) options.settle    = atoi(value);
+        else if (strcmp(arg, "--warmup"   ) == 0) options.warmup    = atoi(value);
+        else if (strcmp(arg, "--reps"     ) == 0) options.reps      = atoi(value);
+        else if (strcmp(arg, "--json"     ) == 0) options.json      = value;
+        else if (strcmp(arg, "--baseline" ) == 0) options.baseline  = value;
+        else if (strcmp(arg, "--threshold") == 0) options.threshold = atof(value);
+        else if (strcmp(arg, "--sizes"    ) == 0 || strcmp(arg, "--threads") == 0){
+            bool sizes = strcmp(arg, "--sizes") == 0;
+            if (!parse_list(value, sizes ? options.sizes : options.threads)){
+                printf("Invalid list %s\n", value);
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--pressure" ) == 0){
+            if      (strcmp(value, "jacobi"   ) == 0) options.pressure = PRESSURE_JACOBI;
+            else if (strcmp(value, "multigrid") == 0) options.pressure = PRESSURE_MULTIGRID;
+            else if (strcmp(value, "fft"      ) == 0) options.pressure = PRESSURE_FFT;
+            else if (strcmp(value, "sor"      ) == 0) options.pressure = PRESSURE_SOR;
+            else {
+                printf("Unknown pressure solver %s\n", value);
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--simd"     ) == 0){
+            if      (strcmp(value, "scalar") == 0) options.simd = SIMD_SCALAR;
+            else if (strcmp(value, "sse"   ) == 0) options.simd = SIMD_SSE;
+            else if (strcmp(value, "avx2"  ) == 0) options.simd = SIMD_AVX2;
+            else if (strcmp(value, "avx512") == 0) options.simd = SIMD_AVX512;
+            else {
+                printf("Unknown instruction set %s\n", value);
+                return false;
+            }
+        }
+        else {
+            printf("Unknown option %s\n", arg);
+            return false;
+        }
+
+        i++;
+    }
+
+    for (int size : options.sizes){
+        if (size < 1){
+            printf("Grid size must be positive\n");
+            return false;
+        }
+    }
+
+    if (options.reps < 1){
+        printf("Need at least one repetition\n");
+        return false;
+    }
+
+    return true;
+}
+
+struct Result {
+    std::string kernel;
+    int nx, ny, threads;
+    int reps;
+    // milliseconds
+    double median, p10, p90, min;
+    double cells_per_sec;
+    // estimate from the bytes each pass has to read and write per cell
+    double gb_per_sec;
+};
+
+// q-th quantile of sorted samples, interpolated between neighbours
+double quantile(const std::vector<double> &sorted, double q){
+    double i = q*(sorted.size() - 1);
+    int i0 = (int)i;
+    int i1 = std::min(i0 + 1, (int)sorted.size() - 1);
+    return lerp(sorted[i0], sorted[i1], i - i0);
+}
+
+template <typename F>
+Result time_kernel(const char *kernel, const Options &options, int nx, int ny, int threads, double bytes_per_cell, F f){
+    for (int i = 0; i < options.warmup; i++) f();
+
+    std::vector<double> samples(options.reps);
+    for (int i = 0; i < options.reps; i++){
+        double t = sec();
+        f();
+        samples[i] = (sec() - t)*1000;
+    }
+    std::sort(samples.begin(), samples.end());
+
+    Result result;
+    result.kernel = kernel;
+    result.nx = nx;
+    result.ny = ny;
+    result.threads = threads;
+    result.reps = options.reps;
+    result.median = quantile(samples, 0.5);
+    result.p10 = quantile(samples, 0.1);
+    result.p90 = quantile(samples, 0.9);
+    result.min = samples[0];
+    double cells = double(nx)*ny;
+    result.cells_per_sec = cells/(result.median*1e-3);
+    result.gb_per_sec = bytes_per_cell*cells/(result.median*1e-3)*1e-9;
+    return result;
+}
+
+// bytes read and written per cell by one pressure solve, roughly
+double pressure_bytes(const FluidSolver &solver){
+    switch (solver.pressure){
+        case PRESSURE_JACOBI: {
+            // p and div in, p out per pass over the grid
+            int block = std::max(solver.jacobi_time_block, 1);
+            int passes = (solver.iterations + block - 1)/block;
+            return 12.0*passes;
+        }
+        case PRESSURE_SOR:
+            // p in and out, div in, per half sweep
+            return 12.0*2*solver.iterations;
+        case PRESSURE_MULTIGRID:
+            // about six passes over the finest level per V-cycle and eight
+            // per W-cycle, the coarser levels add a third
+            return 12.0*(solver.multigrid_gamma == 1 ? 6 : 8)*solver.multigrid_cycles*4/3;
+        case PRESSURE_FFT:
+            // f in, p out and the complex half spectrum four times
+            return 8.0 + 4*8.0*0.5;
+    }
+    return 0.0;
+}
+
+void run_size(const Options &options, int n, int threads, std::vector<Result> &results){
+    ThreadPool pool(threads);
+    FluidSolver solver(n, n, 0.02f, 5, 10.0f, &pool);
+    solver.pressure = options.pressure;
+    solver.simd = get_simd_kernels(options.simd);
+    solver.mouse = vec2f{n*0.5f, n*0.5f};
+
+    // a field with some structure, the first steps are nearly empty
+    for (int i = 0; i < options.settle; i++) solver.step();
+
+    std::vector<uint32_t> pixels(n*n);
+    Colormap colors;
+
+    Splat mouse_splat = {n/2, n/2, 10, 0.5f};
+    Splat sources[] = {
+        {int(n*0.25f), 30, 10, 0.5f},
+        {int(n*0.75f), 30, 10, 0.5f},
+    };
+
+    // u, v and density in and out
+    double forcing = 24.0;
+    // |curl| from u and v, then u, v and |curl| in and new u and v out
+    double vorticity = 12.0 + 20.0;
+    // u and v in, new u and v out, the taps mostly hit cache
+    double advect_velocity = 16.0;
+    double advect_density = 16.0;
+    // divergence, pressure, subtracting the gradient
+    double project = 12.0 + pressure_bytes(solver) + 20.0;
+    double colormap_bytes = 8.0;
+    double step = forcing + vorticity + advect_velocity + project + advect_density;
+
+    int t = pool.size();
+    results.push_back(time_kernel("forcing", options, n, n, t, forcing, [&]{
+        solver.apply_forcing(&mouse_splat, 1, sources, 2);
+    }));
+    results.push_back(time_kernel("vorticity_confinement", options, n, n, t, vorticity, [&]{
+        solver.vorticity_confinement();
+    }));
+    results.push_back(time_kernel("advect_velocity", options, n, n, t, advect_velocity, [&]{
+        solver.advect_velocity();
+    }));
+    results.push_back(time_kernel("project_velocity", options, n, n, t, project, [&]{
+        solver.project_velocity();
+    }));
+    results.push_back(time_kernel("advect_density", options, n, n, t, advect_density, [&]{
+        solver.advect_density();
+    }));
+    results.push_back(time_kernel("colormap", options, n, n, t, colormap_bytes, [&]{
+        colors.apply(solver.density(), pixels.data(), n, n, &pool, solver.simd);
+    }));
+    results.push_back(time_kernel("step", options, n, n, t, step, [&]{
+        solver.step();
+    }));
+}
+
+void print_results(const std::vector<Result> &results){
+    printf("%-22s %11s %7s %10s %10s %10s %12s %8s\n",
+        "kernel", "grid", "threads", "median ms", "p10 ms", "p90 ms", "cells/sec", "GB/s");
+    for (const Result &r : results){
+        char grid[32];
+        snprintf(grid, sizeof(grid), "%ix%i", r.nx, r.ny);
+        printf("%-22s %11s %7i %10.4f %10.4f %10.4f %12.4e %8.2f\n",
+            r.kernel.c_str(), grid, r.threads, r.median, r.p10, r.p90, r.cells_per_sec, r.gb_per_sec);
+    }
+}
+
+const char *pressure_names[] = {"jacobi", "multigrid", "fft", "sor"};
+
+// one result per line, so the baseline can be read back without a JSON library
+bool write_json(const char *path, const Options &options, const std::vector<Result> &results){
+    FILE *fp = fopen(path, "w");
+    if (!fp) return false;
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"simd\": \"%s\",\n", get_simd_kernels(options.simd)->name);
+    fprintf(fp, "  \"pressure\": \"%s\",\n", pressure_names[options.pressure]);
+    fprintf(fp, "  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); i++){
+        const Result &r = results[i];
+        fprintf(fp,
+            "    {\"kernel\": \"%s\", \"nx\": %i, \"ny\": %i, \"threads\": %i, \"reps\": %i, "
+            "\"median_ms\": %.6f, \"p10_ms\": %.6f, \"p90_ms\": %.6f, \"min_ms\": %.6f, "
+            "\"cells_per_sec\": %.6e, \"gb_per_sec\": %.4f}%s\n",
+            r.kernel.c_str(), r.nx, r.ny, r.threads, r.reps,
+            r.median, r.p10, r.p90, r.min,
+            r.cells_per_sec, r.gb_per_sec,
+            i + 1 < results.size() ? "," : "");
+    }
+    fprintf(fp, "  ]\n");
+    fprintf(fp, "}\n");
+    fclose(fp);
+    return true;
+}
+
+// value of "key": in line, false if missing
+bool json_number(const char *line, const char *key, double &value){
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    const char *p = strstr(line, pattern);
+    if (!p) return false;
+    value = atof(p + strlen(pattern));
+    return true;
+}
+
+bool json_string(const char *line, const char *key, std::string &value){
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\": \"", key);
+    const char *p = strstr(line, pattern);
+    if (!p) return false;
+    p += strlen(pattern);
+    const char *end = strchr(p, '"');
+    if (!end) return false;
+    value.assign(p, end);
+    return true;
+}
+
+// also the simd and pressure options the results were measured with
+bool read_json(const char *path, std::vector<Result> &results, std::string &simd, std::string &pressure){
+    FILE *fp = fopen(path, "r");
+    if (!fp) return false;
+
+    char line[1024];
+    while (fgets(line, sizeof(line), fp)){
+        if (json_string(line, "simd", simd) || json_string(line, "pressure", pressure)) continue;
+        Result r;
+        double nx, ny, threads, median;
+        if (!json_string(line, "kernel", r.kernel)) continue;
+        if (!json_number(line, "nx", nx) || !json_number(line, "ny", ny)) continue;
+        if (!json_number(line, "threads", threads) || !json_number(line, "median_ms", median)) continue;
+        r.nx = nx;
+        r.ny = ny;
+        r.threads = threads;
+        r.median = median;
+        results.push_back(r);
+    }
+    fclose(fp);
+    return true;
+}
+
+// prints the change of each median and returns the number of regressions
+int compare(const std::vector<Result> &results, const std::vector<Result> &baseline, double threshold){
+    int regressions = 0;
+    printf("\n%-22s %11s %7s %12s %10s %8s\n", "kernel", "grid", "threads", "baseline ms", "now ms", "change");
+    for (const Result &r : results){
+        const Result *b = nullptr;
+        for (const Result &candidate : baseline){
+            if (candidate.kernel == r.kernel && candidate.nx == r.nx && candidate.ny == r.ny && candidate.threads == r.threads){
+                b = &candidate;
+            }
+        }
+        if (!b) continue;
+
+        double change = r.median/b->median - 1.0;
+        const char *flag = "";
+        if (change > threshold){
+            flag = "  REGRESSION";
+            regressions++;
+        } else if (change < -threshold){
+            flag = "  faster";
+        }
+
+        char grid[32];
+        snprintf(grid, sizeof(grid), "%ix%i", r.nx, r.ny);
+        printf("%-22s %11s %7i %12.4f %10.4f %+7.1f%%%s\n",
+            r.kernel.c_str(), grid, r.threads, b->median, r.median, change*100, flag);
+    }
+    return regressions;
+}
+
+int main(int argc, char **argv){
+    Options options;
+
+    if (!parse_options(options, argc, argv)){
+        usage(argv[0]);
+        return 1;
+    }
+
+    // before running anything, timings of other kernels are no baseline
+    std::vector<Result> baseline;
+    if (options.baseline){
+        std::string simd, pressure;
+        if (!read_json(options.baseline, baseline, simd, pressure)){
+            printf("Could not read %s\n", options.baseline);
+            return 1;
+        }
+        const char *current_simd = get_simd_kernels(options.simd)->name;
+        const char *current_pressure = pressure_names[options.pressure];
+        if (simd != current_simd || pressure != current_pressure){
+            printf("%s was measured with --simd %s --pressure %s, not --simd %s --pressure %s\n",
+                options.baseline, simd.empty() ? "?" : simd.c_str(), pressure.empty() ? "?" : pressure.c_str(),
+                current_simd, current_pressure);
+            return 1;
+        }
+    }
+
+    std::vector<Result> results;
+    for (int size : options.sizes){
+        for (int threads : options.threads){
+            run_size(options, size, threads, results);
+        }
+    }
+
+    printf("simd %s\n\n", get_simd_kernels(options.simd)->name);
+    print_results(results);
+
+    if (options.json && !write_json(options.json, options, results)){
+        printf("Could not write %s\n", options.json);
+        return 1;
+    }
+
+    if (options.baseline){
+        int regressions = compare(results, baseline, options.threshold);
+        if (regressions > 0){
+            printf("\n%i regression(s) over %.0f%%\n", regressions, options.threshold*100);
+            return 2;
+        }
+    }
+
+    return 0;
+}
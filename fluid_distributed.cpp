@@ -0,0 +1,373 @@
+// Runs the CPU fluid solver split into horizontal slabs over several
+// processes on one machine, which exchange ghost rows through shared memory
+// or Unix sockets, and reports the throughput and memory per process. With
+// --scaling it runs 1, 2, ... N processes in turn, with --verify it compares
+// the density with one undivided solver.
+//
+// Build:
+//     g++ -O3 -march=native -pthread fluid_distributed.cpp -o fluid_distributed
+//
+// Example:
+//     ./fluid_distributed --nx 8192 --ny 8192 --ranks 8 --steps 20
+//     ./fluid_distributed --nx 2048 --ny 2048 --ranks 8 --scaling --transport socket
+//     ./fluid_distributed --nx 256 --ny 256 --ranks 4 --verify
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include "slab_solver.h"
+
+enum TransportType {
+    TRANSPORT_SHARED_MEMORY,
+    TRANSPORT_SOCKET,
+};
+
+const char *transport_names[] = {"shm", "socket"};
+
+struct Options {
+    int nx = 1024;
+    int ny = 1024;
+    int steps = 100;
+    int warmup = 10;
+    int ranks = 2;
+    TransportType transport = TRANSPORT_SHARED_MEMORY;
+    // 0 to fit reach
+    int halo = 0;
+    int reach = 8;
+    int threads = 1;
+    int iterations = 5;
+    float dt = 0.02f;
+    float cfl = 0.0f;
+    float min_dt = 0.001f;
+    float vorticity = 10.0f;
+    bool scaling = false;
+    bool verify = false;
+};
+
+void usage(const char *name){
+    printf("Usage: %s [options]\n", name);
+    printf("    --nx N            grid width (default 1024)\n");
+    printf("    --ny N            grid height (default 1024)\n");
+    printf("    --steps N         number of timed steps (default 100)\n");
+    printf("    --warmup N        number of untimed steps before timing (default 10)\n");
+    printf("    --ranks N         processes, each owning ny/N rows (default 2)\n");
+    printf("    --transport NAME  shm or socket (default shm)\n");
+    printf("    --halo N          ghost rows on each side of a slab (default from --reach)\n");
+    printf("    --reach N         rows the velocity may move in one step (default 8)\n");
+    printf("    --threads N       worker threads per process, 0 for all cores (default 1)\n");
+    printf("    --iterations N    Jacobi iterations (default 5)\n");
+    printf("    --dt F            time step, the largest one with --cfl (default 0.02)\n");
+    printf("    --cfl F           adapt the time step so the fastest cell moves F cells\n");
+    printf("    --min-dt F        smallest time step with --cfl (default 0.001)\n");
+    printf("    --vorticity F     vorticity confinement strength (default 10)\n");
+    printf("    --scaling         run 1, 2, ... up to --ranks processes\n");
+    printf("    --verify          compare the density with a single solver\n");
+}
+
+bool parse_options(Options &options, int argc, char **argv){
+    for (int i = 1; i < argc; i++){
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) return false;
+
+        if (strcmp(arg, "--scaling") == 0){
+            options.scaling = true;
+            continue;
+        }
+
+        if (strcmp(arg, "--verify") == 0){
+            options.verify = true;
+            continue;
+        }
+
+        if (!value){
+            printf("Missing value for %s\n", arg);
+            return false;
+        }
+
+        if      (strcmp(arg, "--nx"        ) == 0) options.nx         = atoi(value);
+        else if (strcmp(arg, "--ny"        ) == 0) options.ny         = atoi(value);
+        else if (strcmp(arg, "--steps"     ) == 0) options.steps      = atoi(value);
+        else if (strcmp(arg, "--warmup"    ) == 0) options.warmup     = atoi(value);
+        else if (strcmp(arg, "--ranks"     ) == 0) options.ranks      = atoi(value);
+        else if (strcmp(arg, "--halo"      ) == 0) options.halo       = atoi(value);
+        else if (strcmp(arg, "--reach"     ) == 0) options.reach      = atoi(value);
+        else if (strcmp(arg, "--threads"   ) == 0) options.threads    = atoi(value);
+        else if (strcmp(arg, "--iterations") == 0) options.iterations = atoi(value);
+        else if (strcmp(arg, "--dt"        ) == 0) options.dt         = atof(value);
+        else if (strcmp(arg, "--cfl"       ) == 0) options.cfl        = atof(value);
+        else if (strcmp(arg, "--min-dt"    ) == 0) options.min_dt     = atof(value);
+        else if (strcmp(arg, "--vorticity" ) == 0) options.vorticity  = atof(value);
+        else if (strcmp(arg, "--transport" ) == 0){
+            if      (strcmp(value, "shm"   ) == 0) options.transport = TRANSPORT_SHARED_MEMORY;
+            else if (strcmp(value, "socket") == 0) options.transport = TRANSPORT_SOCKET;
+            else {
+                printf("Unknown transport %s\n", value);
+                return false;
+            }
+        }
+        else {
+            printf("Unknown option %s\n", arg);
+            return false;
+        }
+        i++;
+    }
+
+    if (options.nx < 1 || options.ny < 1 || options.ranks < 1 || options.steps < 1 || options.iterations < 1){
+        printf("Invalid options\n");
+        return false;
+    }
+
+    if (options.halo == 0) options.halo = SlabSolver::min_halo(options.reach, options.iterations);
+    if (options.halo < SlabSolver::min_halo(1, options.iterations)){
+        printf("The halo needs at least %i rows for %i Jacobi iterations\n",
+            SlabSolver::min_halo(1, options.iterations), options.iterations);
+        return false;
+    }
+
+    if (options.ny/options.ranks < options.halo){
+        printf("%i ranks leave fewer rows per rank than the halo of %i\n", options.ranks, options.halo);
+        return false;
+    }
+
+    return true;
+}
+
+// written by each rank into memory shared with the launcher
+struct RankResult {
+    // 0 if all steps ran
+    int status;
+    int failed_step;
+    float max_speed;
+    double elapsed;
+    double exchange;
+    double density_sum;
+    size_t memory;
+};
+
+enum RankStatus {
+    RANK_OK,
+    RANK_TRANSPORT_FAILED,
+    RANK_REACH_EXCEEDED,
+};
+
+template <typename T>
+T* map_shared(size_t count){
+    void *p = mmap(nullptr, count*sizeof(T), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? nullptr : (T*)p;
+}
+
+void configure(FluidSolver &solver, const Options &options){
+    solver.min_dt = options.min_dt;
+    solver.max_dt = options.dt;
+}
+
+// The body of one forked process. The density of the owned rows goes to
+// gathered if it is not null.
+int run_rank(const Options &options, Transport &transport, int rank, RankResult &result, float *gathered){
+    transport.attach(rank);
+    ThreadPool pool(options.threads);
+    SlabSolver slab(transport, options.nx, options.ny, options.halo,
+        options.dt, options.iterations, options.vorticity, &pool);
+    configure(slab.solver, options);
+    slab.cfl = options.cfl;
+
+    int steps = options.warmup + options.steps;
+    double t = 0.0;
+    for (int i = 0; i < steps; i++){
+        if (i == options.warmup){
+            // all ranks start the clock together
+            double ready = 0.0;
+            if (!all_reduce(transport, ready, [](double a, double b){ return a + b; })) return RANK_TRANSPORT_FAILED;
+            slab.exchange_time = 0.0;
+            t = sec();
+        }
+        if (!slab.step()){
+            result.failed_step = i + 1;
+            result.max_speed = slab.max_speed;
+            return slab.too_fast ? RANK_REACH_EXCEEDED : RANK_TRANSPORT_FAILED;
+        }
+    }
+    result.elapsed = sec() - t;
+    result.exchange = slab.exchange_time;
+    result.density_sum = slab.density_sum();
+    result.memory = slab.memory_bytes();
+    result.max_speed = slab.max_speed;
+
+    if (gathered){
+        for (int y = slab.y0; y < slab.y1; y++){
+            memcpy(gathered + size_t(y)*options.nx, slab.density_row(y), options.nx*sizeof(float));
+        }
+    }
+    return RANK_OK;
+}
+
+struct RunResult {
+    double elapsed;
+    double exchange;
+    double density_sum;
+    size_t memory;
+};
+
+// Forks ranks processes which each run one slab and waits for all of them.
+// If one fails the others are killed, they would wait for it forever.
+bool run(const Options &options, int ranks, RunResult &run_result, float *gathered){
+    std::unique_ptr<Transport> transport;
+    if (options.transport == TRANSPORT_SOCKET){
+        SocketTransport *sockets = new SocketTransport(ranks);
+        transport.reset(sockets);
+        if (!sockets->is_open()){
+            printf("Could not create sockets\n");
+            return false;
+        }
+    } else {
+        SharedMemoryTransport *shm = new SharedMemoryTransport(ranks);
+        transport.reset(shm);
+        if (!shm->is_open()){
+            printf("Could not map shared memory\n");
+            return false;
+        }
+    }
+
+    RankResult *results = map_shared<RankResult>(ranks);
+    if (!results){
+        printf("Could not map shared memory\n");
+        return false;
+    }
+    memset(results, 0, ranks*sizeof(RankResult));
+
+    fflush(stdout);
+    std::vector<pid_t> pids;
+    for (int r = 0; r < ranks; r++){
+        pid_t pid = fork();
+        if (pid == 0){
+            int status = run_rank(options, *transport, r, results[r], gathered);
+            results[r].status = status;
+            fflush(stdout);
+            _exit(status);
+        }
+        if (pid < 0){
+            printf("Could not fork rank %i\n", r);
+            for (pid_t p : pids) kill(p, SIGKILL);
+            for (pid_t p : pids) waitpid(p, nullptr, 0);
+            munmap(results, ranks*sizeof(RankResult));
+            return false;
+        }
+        pids.push_back(pid);
+    }
+
+    bool ok = true;
+    for (int remaining = ranks; remaining > 0; remaining--){
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) break;
+        if (ok && (!WIFEXITED(status) || WEXITSTATUS(status) != RANK_OK)){
+            ok = false;
+            for (pid_t p : pids) if (p != pid) kill(p, SIGKILL);
+        }
+    }
+
+    if (!ok){
+        for (int r = 0; r < ranks; r++){
+            if (results[r].status == RANK_REACH_EXCEEDED){
+                printf("Step %i: the velocity of %f cells/s came too close to moving further than the halo of %i rows covers, use a larger --reach or --halo\n",
+                    results[r].failed_step, results[r].max_speed, options.halo);
+                break;
+            }
+        }
+        printf("A rank failed\n");
+    } else {
+        run_result = RunResult{0.0, 0.0, 0.0, 0};
+        for (int r = 0; r < ranks; r++){
+            run_result.elapsed = std::max(run_result.elapsed, results[r].elapsed);
+            run_result.exchange = std::max(run_result.exchange, results[r].exchange);
+            run_result.density_sum += results[r].density_sum;
+            run_result.memory = std::max(run_result.memory, results[r].memory);
+        }
+    }
+    munmap(results, ranks*sizeof(RankResult));
+    return ok;
+}
+
+// the density of a single solver after the same steps against gathered
+void verify(const Options &options, const float *gathered){
+    int nx = options.nx;
+    int ny = options.ny;
+    ThreadPool pool(options.threads);
+    FluidSolver solver(nx, ny, options.dt, options.iterations, options.vorticity, &pool);
+    configure(solver, options);
+    solver.cfl = options.cfl;
+    for (int i = 0; i < options.warmup + options.steps; i++) solver.step();
+
+    double error_sum = 0.0;
+    double sum = 0.0;
+    double max_error = 0.0;
+    double reference_sum = 0.0;
+    FOR_EACH_CELL {
+        double d = double(gathered[size_t(y)*nx + x]) - solver.old_density(x, y);
+        error_sum += d*d;
+        sum += double(solver.old_density(x, y))*solver.old_density(x, y);
+        max_error = std::max(max_error, fabs(d));
+        reference_sum += solver.old_density(x, y);
+    }
+    printf("\nagainst a single solver after %i steps\n", options.warmup + options.steps);
+    printf("density sum      %f single\n", reference_sum);
+    printf("density rms      %e relative\n", sum > 0.0 ? sqrt(error_sum/sum) : sqrt(error_sum));
+    printf("density max      %e\n", max_error);
+}
+
+int main(int argc, char **argv){
+    Options options;
+    if (!parse_options(options, argc, argv)){
+        usage(argv[0]);
+        return 1;
+    }
+
+    float *gathered = nullptr;
+    if (options.verify){
+        gathered = map_shared<float>(size_t(options.nx)*options.ny);
+        if (!gathered){
+            printf("Could not map shared memory\n");
+            return 1;
+        }
+    }
+
+    double cells = double(options.nx)*options.ny;
+    printf("grid             %i x %i\n", options.nx, options.ny);
+    printf("steps            %i\n", options.steps);
+    printf("transport        %s\n", transport_names[options.transport]);
+    printf("halo             %i rows, reach %i rows per step\n",
+        options.halo, options.halo - SlabSolver::min_halo(0, options.iterations));
+    printf("threads          %i per rank\n", ThreadPool::default_threads(options.threads));
+    printf("\n%6s %8s %10s %10s %13s %14s %8s %11s\n",
+        "ranks", "rows", "MB/rank", "ms/step", "cells/sec", "exchange ms", "speedup", "efficiency");
+
+    // ms/step of one rank
+    double single = 0.0;
+    double density_sum = 0.0;
+    for (int ranks = options.scaling ? 1 : options.ranks; ranks <= options.ranks; ranks++){
+        RunResult result;
+        bool last = ranks == options.ranks;
+        if (!run(options, ranks, result, last ? gathered : nullptr)) return 1;
+        double ms = result.elapsed*1000/options.steps;
+        if (ranks == 1) single = ms;
+        printf("%6i %8i %10.1f %10.3f %13e %14.3f", ranks, options.ny/ranks, result.memory*1e-6,
+            ms, cells*options.steps/result.elapsed, result.exchange*1000/options.steps);
+        if (single > 0.0) printf(" %8.2f %10.0f%%", single/ms, single/ms/ranks*100);
+        printf("\n");
+        density_sum = result.density_sum;
+    }
+    printf("\ndensity sum      %f\n", density_sum);
+
+    if (options.verify) verify(options, gathered);
+    return 0;
+}
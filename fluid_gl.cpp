@@ -1,4 +1,6 @@
 #include "shader.h"
+#include <string.h>
+#include "frame_writer.h"
 
 int w = 1920;
 int h = 1080;
@@ -94,25 +96,11 @@ void reshape(int new_width, int new_height){
     CHECK_GL
 }
 
-void screenshot(const char *path){
-    std::vector<uint32_t> rgba(w*h);
-    std::vector<uint8_t> rgb(w*h*3);
+FrameWriter writer;
 
-    glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, rgba.data());
-
-    int i = 0;
-    for (int y = h - 1; y >= 0; y--) for (int x = 0; x < w; x++){
-        uint32_t c = rgba[x + y*w];
-        rgb[i++] = (c >> 0*8) & 255;
-        rgb[i++] = (c >> 1*8) & 255;
-        rgb[i++] = (c >> 2*8) & 255;
-    }
-
-    FILE *fp = fopen(path, "wb");
-    assert(fp);
-    fprintf(fp, "P6\n%i %i\n255\n", w, h);
-    fwrite(rgb.data(), 1, rgb.size(), fp);
-    fclose(fp);
+void close_writer(){
+    writer.close();
+    if (writer.frames_submitted + writer.frames_dropped > 0) writer.print_stats(stdout);
 }
 
 typedef std::vector<Vertex> Vertices;
@@ -184,18 +172,12 @@ void on_frame(){
 
     glEndQuery(GL_TIME_ELAPSED);
 
-#if 0
-    // Warning: produces almost 6 GB of images
-    static int frame = 0;
-    char path[256];
-    snprintf(path, sizeof(path), "frames_gl/frame_%d.ppm", frame);
-    screenshot(path);
-    puts(path);
-    frame++;
-    if (frame >= 1024){
-        exit(0);
+    if (writer.is_open()){
+        if (uint32_t *frame = writer.acquire()){
+            glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, frame);
+            writer.submit();
+        }
     }
-#endif
     glFlush();
     glFinish();
 
@@ -243,6 +225,16 @@ int main(int argc, char **argv){
 
     glewInit();
 
+    // ./fluid_gl --record video.y4m [--drop-frames], or --record "|ffmpeg -i - video.mp4"
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "--record") == 0 && i + 1 < argc){
+            if (!writer.open(argv[++i], w, h)) return 1;
+        } else if (strcmp(argv[i], "--drop-frames") == 0){
+            writer.drop_when_full = true;
+        }
+    }
+    atexit(close_writer);
+
 #define STR(x) #x
 
     const char *vert_src = STR(
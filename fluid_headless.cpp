@@ -0,0 +1,754 @@
+// Runs the CPU fluid solver without a window and reports throughput.
+//
+// Build:
+//     g++ -O3 -march=native -pthread fluid_headless.cpp -o fluid_headless
+//
+// Example:
+//     ./fluid_headless --nx 1024 --ny 1024 --steps 100
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include "fluid_solver.h"
+#include "ensemble.h"
+#include "colormap.h"
+#include "frame_writer.h"
+#include "archive.h"
+#include "shared_fields.h"
+#include "allocation_counter.h"
+
+// type of the velocity and density grids
+enum Storage {
+    STORAGE_FLOAT,
+    STORAGE_FLOAT16,
+    STORAGE_BFLOAT16,
+};
+
+const char *storage_names[] = {"float", "float16", "bfloat16"};
+
+// parameter spread over the members of an ensemble
+enum SweepParameter {
+    SWEEP_NONE,
+    SWEEP_VORTICITY,
+    SWEEP_DT,
+    SWEEP_BUOYANCY,
+    SWEEP_ITERATIONS,
+};
+
+const char *sweep_names[] = {"none", "vorticity", "dt", "buoyancy", "iterations"};
+
+struct Options {
+    int nx = 256;
+    int ny = 256;
+    int steps = 200;
+    int warmup = 10;
+    float dt = 0.02f;
+    float cfl = 0.0f;
+    float min_dt = 0.001f;
+    bool sparse = false;
+    float sparse_threshold = 1e-4f;
+    int iterations = 5;
+    float vorticity = 10.0f;
+    unsigned seed = 1;
+    int threads = 0;
+    PressureMethod pressure = PRESSURE_JACOBI;
+    float omega = 1.0f;
+    int cycles = 2;
+    int gamma = 1;
+    int time_block = 5;
+    int tile_rows = 32;
+    bool compare_pressure = false;
+    Storage storage = STORAGE_FLOAT;
+    bool compare_storage = false;
+    SimdLevel simd = best_simd_level();
+    const char *trace = NULL;
+    bool perf = false;
+    const char *record = NULL;
+    // of the video, 0 for the grid size
+    int record_w = 0;
+    int record_h = 0;
+    Palette palette = PALETTE_FIRE;
+    bool drop_frames = false;
+    const char *checkpoint = NULL;
+    int checkpoint_every = 0;
+    const char *restart = NULL;
+    const char *archive = NULL;
+    int archive_every = 10;
+    float quantum = 1e-3f;
+    const char *publish = NULL;
+    int publish_slots = 4;
+    // members of an ensemble, 0 for a single solver
+    int ensemble = 0;
+    SweepParameter sweep = SWEEP_NONE;
+    float sweep_from = 0.0f;
+    float sweep_to = 0.0f;
+};
+
+void usage(const char *name){
+    printf("Usage: %s [options]\n", name);
+    printf("    --nx N            grid width (default 256)\n");
+    printf("    --ny N            grid height (default 256)\n");
+    printf("    --steps N         number of timed steps (default 200)\n");
+    printf("    --warmup N        number of untimed steps before timing (default 10)\n");
+    printf("    --dt F            time step, the largest one with --cfl (default 0.02)\n");
+    printf("    --cfl F           adapt the time step so the fastest cell moves F cells\n");
+    printf("    --min-dt F        smallest time step with --cfl (default 0.001)\n");
+    printf("    --sparse          advect the density only in tiles which hold some\n");
+    printf("    --sparse-threshold F\n");
+    printf("                      density below which a tile counts as empty (default 0.0001)\n");
+    printf("    --iterations N    Jacobi or SOR iterations (default 5)\n");
+    printf("    --vorticity F     vorticity confinement strength (default 10)\n");
+    printf("    --seed N          random seed for velocity noise (default 1)\n");
+    printf("    --threads N       worker threads, 0 for all cores (default 0)\n");
+    printf("    --pressure NAME   pressure solver: jacobi, sor, multigrid, fft (default jacobi)\n");
+    printf("    --omega F         relaxation factor of red-black SOR (default 1.0)\n");
+    printf("    --cycles N        multigrid cycles per step (default 2)\n");
+    printf("    --cycle v|w       multigrid cycle type (default v)\n");
+    printf("    --time-block N    Jacobi iterations per pass over the grid (default 5)\n");
+    printf("    --tile-rows N     rows per tile of those passes (default 32)\n");
+    printf("    --simd NAME       kernels: scalar, sse, avx2, avx512 (default widest supported)\n");
+    printf("    --storage NAME    velocity and density as float, float16 or bfloat16\n");
+    printf("                      (default float)\n");
+    printf("    --trace PATH      write a Chrome trace of the steps to PATH and print\n");
+    printf("                      histograms of the phases, needs -DFLUID_PROFILE\n");
+    printf("    --perf            read hardware counters around each phase (Linux)\n");
+    printf("    --record PATH     write the density of every timed step as Y4M video,\n");
+    printf("                      |COMMAND pipes it into a command instead\n");
+    printf("    --record-size WxH size of the video (default grid size)\n");
+    printf("    --palette NAME    colors of the video: fire, ice, gray, viridis (default fire)\n");
+    printf("    --drop-frames     drop frames rather than wait while the writer is behind\n");
+    printf("    --checkpoint PATH save the solver state to PATH after the timed steps\n");
+    printf("    --checkpoint-every N\n");
+    printf("                      and also after every N timed steps\n");
+    printf("    --restart PATH    resume from a checkpoint instead of the warmup steps,\n");
+    printf("                      the grid size and parameters come from the checkpoint\n");
+    printf("    --archive PATH    keep density and velocity of every Nth timed step in a\n");
+    printf("                      compressed archive, see fluid_archive.cpp\n");
+    printf("    --archive-every N steps between archived frames (default 10)\n");
+    printf("    --quantum F       quantization step of the archive, 0 for lossless (default 0.001)\n");
+    printf("    --publish NAME    publish every timed step to the shared memory segment NAME,\n");
+    printf("                      e.g. /fluid, see shared_fields.h\n");
+    printf("    --publish-slots N frames kept in the segment (default 4)\n");
+    printf("    --ensemble N      step N solvers together and report their combined\n");
+    printf("                      throughput, see ensemble.h\n");
+    printf("    --sweep NAME:A:B  spread vorticity, dt, buoyancy or iterations evenly\n");
+    printf("                      from A to B over the members of the ensemble\n");
+    printf("    --compare-pressure\n");
+    printf("                      report residual vs. time of the pressure solvers\n");
+    printf("                      on the velocity field after the warmup steps\n");
+    printf("    --compare-storage\n");
+    printf("                      run float16 and bfloat16 storage next to float for\n");
+    printf("                      the warmup and timed steps and report their error\n");
+}
+
+bool parse_options(Options &options, int argc, char **argv){
+    for (int i = 1; i < argc; i++){
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) return false;
+
+        if (strcmp(arg, "--compare-pressure") == 0){
+            options.compare_pressure = true;
+            continue;
+        }
+
+        if (strcmp(arg, "--compare-storage") == 0){
+            options.compare_storage = true;
+            continue;
+        }
+
+        if (strcmp(arg, "--sparse") == 0){
+            options.sparse = true;
+            continue;
+        }
+
+        if (strcmp(arg, "--perf") == 0){
+            options.perf = true;
+            continue;
+        }
+
+        if (strcmp(arg, "--drop-frames") == 0){
+            options.drop_frames = true;
+            continue;
+        }
+
+        if (!value){
+            printf("Missing value for %s\n", arg);
+            return false;
+        }
+
+        if      (strcmp(arg, "--nx"        ) == 0) options.nx         = atoi(value);
+        else if (strcmp(arg, "--ny"        ) == 0) options.ny         = atoi(value);
+        else if (strcmp(arg, "--steps"     ) == 0) options.steps      = atoi(value);
+        else if (strcmp(arg, "--warmup"    ) == 0) options.warmup     = atoi(value);
+        else if (strcmp(arg, "--dt"        ) == 0) options.dt         = atof(value);
+        else if (strcmp(arg, "--cfl"       ) == 0) options.cfl        = atof(value);
+        else if (strcmp(arg, "--min-dt"    ) == 0) options.min_dt     = atof(value);
+        else if (strcmp(arg, "--sparse-threshold") == 0) options.sparse_threshold = atof(value);
+        else if (strcmp(arg, "--iterations") == 0) options.iterations = atoi(value);
+        else if (strcmp(arg, "--vorticity" ) == 0) options.vorticity  = atof(value);
+        else if (strcmp(arg, "--seed"      ) == 0) options.seed       = atoi(value);
+        else if (strcmp(arg, "--threads"   ) == 0) options.threads    = atoi(value);
+        else if (strcmp(arg, "--cycles"    ) == 0) options.cycles     = atoi(value);
+        else if (strcmp(arg, "--omega"     ) == 0) options.omega      = atof(value);
+        else if (strcmp(arg, "--time-block") == 0) options.time_block = atoi(value);
+        else if (strcmp(arg, "--tile-rows" ) == 0) options.tile_rows  = atoi(value);
+        else if (strcmp(arg, "--trace"     ) == 0) options.trace      = value;
+        else if (strcmp(arg, "--record"    ) == 0) options.record     = value;
+        else if (strcmp(arg, "--checkpoint") == 0) options.checkpoint = value;
+        else if (strcmp(arg, "--checkpoint-every") == 0) options.checkpoint_every = atoi(value);
+        else if (strcmp(arg, "--restart"   ) == 0) options.restart    = value;
+        else if (strcmp(arg, "--archive"   ) == 0) options.archive    = value;
+        else if (strcmp(arg, "--archive-every") == 0) options.archive_every = atoi(value);
+        else if (strcmp(arg, "--quantum"   ) == 0) options.quantum    = atof(value);
+        else if (strcmp(arg, "--publish"   ) == 0) options.publish    = value;
+        else if (strcmp(arg, "--publish-slots") == 0) options.publish_slots = atoi(value);
+        else if (strcmp(arg, "--ensemble"  ) == 0) options.ensemble   = atoi(value);
+        else if (strcmp(arg, "--sweep"     ) == 0){
+            char name[32];
+            if (sscanf(value, "%31[^:]:%f:%f", name, &options.sweep_from, &options.sweep_to) != 3){
+                printf("Invalid sweep %s, expected NAME:FROM:TO\n", value);
+                return false;
+            }
+            if      (strcmp(name, "vorticity" ) == 0) options.sweep = SWEEP_VORTICITY;
+            else if (strcmp(name, "dt"        ) == 0) options.sweep = SWEEP_DT;
+            else if (strcmp(name, "buoyancy"  ) == 0) options.sweep = SWEEP_BUOYANCY;
+            else if (strcmp(name, "iterations") == 0) options.sweep = SWEEP_ITERATIONS;
+            else {
+                printf("Unknown sweep parameter %s\n", name);
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--pressure"  ) == 0){
+            if      (strcmp(value, "jacobi"   ) == 0) options.pressure = PRESSURE_JACOBI;
+            else if (strcmp(value, "multigrid") == 0) options.pressure = PRESSURE_MULTIGRID;
+            else if (strcmp(value, "fft"      ) == 0) options.pressure = PRESSURE_FFT;
+            else if (strcmp(value, "sor"      ) == 0) options.pressure = PRESSURE_SOR;
+            else {
+                printf("Unknown pressure solver %s\n", value);
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--simd"      ) == 0){
+            if      (strcmp(value, "scalar") == 0) options.simd = SIMD_SCALAR;
+            else if (strcmp(value, "sse"   ) == 0) options.simd = SIMD_SSE;
+            else if (strcmp(value, "avx2"  ) == 0) options.simd = SIMD_AVX2;
+            else if (strcmp(value, "avx512") == 0) options.simd = SIMD_AVX512;
+            else {
+                printf("Unknown instruction set %s\n", value);
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--record-size") == 0){
+            if (sscanf(value, "%ix%i", &options.record_w, &options.record_h) != 2 || options.record_w < 1 || options.record_h < 1){
+                printf("Invalid video size %s\n", value);
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--palette"   ) == 0){
+            if (!parse_palette(value, options.palette)) return false;
+        }
+        else if (strcmp(arg, "--storage"   ) == 0){
+            if      (strcmp(value, "float"   ) == 0) options.storage = STORAGE_FLOAT;
+            else if (strcmp(value, "float16" ) == 0) options.storage = STORAGE_FLOAT16;
+            else if (strcmp(value, "bfloat16") == 0) options.storage = STORAGE_BFLOAT16;
+            else {
+                printf("Unknown storage type %s\n", value);
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--cycle"     ) == 0){
+            if      (strcmp(value, "v") == 0) options.gamma = 1;
+            else if (strcmp(value, "w") == 0) options.gamma = 2;
+            else {
+                printf("Unknown cycle type %s\n", value);
+                return false;
+            }
+        }
+        else {
+            printf("Unknown option %s\n", arg);
+            return false;
+        }
+        i++;
+    }
+
+    if (options.nx < 1 || options.ny < 1){
+        printf("Grid size must be positive\n");
+        return false;
+    }
+
+    if (options.ensemble > 0 && (
+        options.record || options.archive || options.publish || options.checkpoint || options.restart ||
+        options.compare_pressure || options.compare_storage || options.perf
+    )){
+        printf("--ensemble only runs and times the steps\n");
+        return false;
+    }
+
+    if (options.sweep != SWEEP_NONE && options.ensemble < 1){
+        printf("--sweep needs --ensemble\n");
+        return false;
+    }
+
+    if ((options.checkpoint || options.restart) && options.storage != STORAGE_FLOAT){
+        printf("Checkpoints need --storage float\n");
+        return false;
+    }
+
+    return true;
+}
+
+template <typename T>
+double density_sum(const BasicFluidSolver<T> &solver){
+    const Grid<T> &density = solver.density();
+    int nx = density.nx;
+    int ny = density.ny;
+    double sum = 0.0;
+    FOR_EACH_CELL sum += density(x, y);
+    return sum;
+}
+
+double rms(const Grid<float> &grid){
+    int nx = grid.nx;
+    int ny = grid.ny;
+    double sum = 0.0;
+    FOR_EACH_CELL sum += double(grid(x, y))*grid(x, y);
+    return sqrt(sum/(nx*ny));
+}
+
+// Multigrid on sizes whose hierarchy ends early: odd sides have a single
+// level, others stop at an odd coarsest level. The right hand side is a
+// mix of waves without a constant part. False if some size does not
+// converge.
+bool check_multigrid_sizes(ThreadPool *pool){
+    const int sizes[][2] = {{256, 256}, {255, 255}, {254, 254}, {192, 160}, {100, 60}, {97, 128}};
+    const int cycles = 8;
+    const double tolerance = 1e-4;
+
+    printf("\n%-10s %8s %12s %14s\n", "size", "levels", "coarsest", "rel. residual");
+    bool ok = true;
+    for (const int *size : sizes){
+        int nx = size[0];
+        int ny = size[1];
+        Grid<float> p(nx, ny), f(nx, ny);
+        FOR_EACH_CELL {
+            float a = 2.0f*float(M_PI)*x/nx;
+            float b = 2.0f*float(M_PI)*y/ny;
+            f(x, y) = sinf(3.0f*a)*cosf(2.0f*b) + 0.5f*sinf(a + 5.0f*b) + 0.25f*cosf(17.0f*a - 11.0f*b);
+        }
+        f.fill_halo();
+        p.fill(0.0f);
+
+        Multigrid multigrid(nx, ny);
+        multigrid.pool = pool;
+        multigrid.solve(p, f, cycles);
+        double residual = multigrid.residual(p, f)/rms(f);
+        const Multigrid::Level &coarsest = *multigrid.levels.back();
+
+        char name[32], coarsest_name[32];
+        snprintf(name, sizeof(name), "%ix%i", nx, ny);
+        snprintf(coarsest_name, sizeof(coarsest_name), "%ix%i", coarsest.nx, coarsest.ny);
+        bool converged = residual < tolerance;
+        printf("%-10s %8i %12s %14e%s\n", name, (int)multigrid.levels.size(), coarsest_name,
+            residual, converged ? "" : "  not converged");
+        ok = ok && converged;
+    }
+    return ok;
+}
+
+// Solves the pressure equation of the current velocity field with each
+// solver for an increasing amount of work and prints relative residuals,
+// then checks multigrid on other sizes. False if that check fails.
+template <typename T>
+bool compare_pressure(BasicFluidSolver<T> &solver){
+    int nx = solver.nx;
+    int ny = solver.ny;
+    ScratchGrid<float> p(*solver.workspace, nx, ny);
+    ScratchGrid<float> div(*solver.workspace, nx, ny);
+
+    solver.compute_divergence(div);
+    Multigrid &multigrid = solver.get_multigrid();
+    double norm = rms(div);
+
+    printf("%-10s %8s %12s %14s\n", "solver", "work", "time [ms]", "rel. residual");
+    printf("%-10s %8i %12f %14e\n", "none", 0, 0.0, 1.0);
+
+    int jacobi_iterations[] = {5, 10, 20, 50, 100, 200, 500, 1000, 2000};
+    for (int iterations : jacobi_iterations){
+        p.fill(0.0f);
+        double t = sec();
+        solver.jacobi(p, div, iterations);
+        t = sec() - t;
+        printf("%-10s %8i %12f %14e\n", "jacobi", iterations, t*1000, multigrid.residual(p, div)/norm);
+    }
+
+    for (int iterations : jacobi_iterations){
+        p.fill(0.0f);
+        double t = sec();
+        solver.red_black_sor(p, div, iterations, solver.sor_omega);
+        t = sec() - t;
+        printf("%-10s %8i %12f %14e\n", "sor", iterations, t*1000, multigrid.residual(p, div)/norm);
+    }
+
+    for (int gamma = 1; gamma <= 2; gamma++){
+        multigrid.gamma = gamma;
+        for (int cycles = 1; cycles <= 8; cycles++){
+            p.fill(0.0f);
+            double t = sec();
+            multigrid.solve(p, div, cycles);
+            t = sec() - t;
+            const char *name = gamma == 1 ? "mg-v" : "mg-w";
+            printf("%-10s %8i %12f %14e\n", name, cycles, t*1000, multigrid.residual(p, div)/norm);
+        }
+    }
+
+    FftPoisson &fft_poisson = solver.get_fft_poisson();
+    // the first solve would include the thread local scratch allocation
+    fft_poisson.solve(p, div);
+    double t = sec();
+    fft_poisson.solve(p, div);
+    t = sec() - t;
+    printf("%-10s %8i %12f %14e\n", "fft", 1, t*1000, multigrid.residual(p, div)/norm);
+
+    return check_multigrid_sizes(solver.pool);
+}
+
+template <typename T>
+void configure(BasicFluidSolver<T> &solver, const Options &options){
+    solver.pressure = options.pressure;
+    solver.sor_omega = options.omega;
+    solver.multigrid_cycles = options.cycles;
+    solver.multigrid_gamma = options.gamma;
+    solver.jacobi_time_block = options.time_block;
+    solver.jacobi_tile_rows = options.tile_rows;
+    solver.simd = get_simd_kernels<T>(options.simd);
+    solver.seed = options.seed;
+    solver.cfl = options.cfl;
+    solver.min_dt = options.min_dt;
+    solver.max_dt = options.dt;
+    solver.sparse = options.sparse;
+    solver.sparse_threshold = options.sparse_threshold;
+}
+
+// checkpoints hold float grids, parse_options() rejects them for the others
+template <typename T>
+bool save_checkpoint(const BasicFluidSolver<T> &solver, const char *path){
+    if constexpr (std::is_same<T, float>::value) return solver.save_checkpoint(path);
+    else return false;
+}
+
+template <typename T>
+bool load_checkpoint(BasicFluidSolver<T> &solver, const char *path){
+    if constexpr (std::is_same<T, float>::value) return solver.load_checkpoint(path);
+    else return false;
+}
+
+struct StorageError {
+    // RMS of the difference relative to the RMS of the float field
+    double relative_rms = 0.0;
+    double max = 0.0;
+};
+
+// of u and v together if the second pair is given
+template <typename T>
+StorageError storage_error(
+    const Grid<T> &a, const Grid<float> &a_reference,
+    const Grid<T> *b = nullptr, const Grid<float> *b_reference = nullptr
+){
+    int nx = a.nx;
+    int ny = a.ny;
+    double error_sum = 0.0;
+    double sum = 0.0;
+    StorageError error;
+    for (int k = 0; k < (b ? 2 : 1); k++){
+        const Grid<T> &grid = k == 0 ? a : *b;
+        const Grid<float> &reference = k == 0 ? a_reference : *b_reference;
+        FOR_EACH_CELL {
+            double d = double(float(grid(x, y))) - reference(x, y);
+            error_sum += d*d;
+            sum += double(reference(x, y))*reference(x, y);
+            error.max = std::max(error.max, fabs(d));
+        }
+    }
+    error.relative_rms = sum > 0.0 ? sqrt(error_sum/sum) : sqrt(error_sum);
+    return error;
+}
+
+template <typename T>
+void print_storage_error(const char *name, int step, const BasicFluidSolver<T> &solver, const FluidSolver &reference){
+    StorageError density = storage_error(solver.old_density, reference.old_density);
+    StorageError velocity = storage_error(solver.old_u, reference.old_u, &solver.old_v, &reference.old_v);
+    double sum = density_sum(reference);
+    double drift = sum != 0.0 ? (density_sum(solver) - sum)/sum : 0.0;
+    printf("%8i %-9s %13e %13e %13e %13e %+13e\n", step, name,
+        density.relative_rms, density.max, velocity.relative_rms, velocity.max, drift);
+}
+
+// Runs float16 and bfloat16 storage next to float from the same start and
+// prints how far their fields have drifted from the float ones after 1, 2,
+// 5, 10, 20, ... steps. The flow is chaotic, so the rounding errors grow
+// until the fields are as far apart as two unrelated ones.
+void compare_storage(const Options &options, ThreadPool *pool){
+    FluidSolver reference(options.nx, options.ny, options.dt, options.iterations, options.vorticity, pool);
+    BasicFluidSolver<float16> fp16(options.nx, options.ny, options.dt, options.iterations, options.vorticity, pool);
+    BasicFluidSolver<bfloat16> bf16(options.nx, options.ny, options.dt, options.iterations, options.vorticity, pool);
+    configure(reference, options);
+    configure(fp16, options);
+    configure(bf16, options);
+
+    printf("errors against float storage, relative RMS and largest difference\n");
+    printf("%8s %-9s %13s %13s %13s %13s %13s\n", "step", "storage",
+        "density rms", "density max", "velocity rms", "velocity max", "sum drift");
+
+    int steps = options.warmup + options.steps;
+    int report = 1;
+    double t[3] = {0.0, 0.0, 0.0};
+    for (int i = 1; i <= steps; i++){
+        double t0 = sec();
+        reference.step();
+        double t1 = sec();
+        fp16.step();
+        double t2 = sec();
+        bf16.step();
+        double t3 = sec();
+        t[0] += t1 - t0;
+        t[1] += t2 - t1;
+        t[2] += t3 - t2;
+        if (i == report || i == steps){
+            print_storage_error("float16", i, fp16, reference);
+            print_storage_error("bfloat16", i, bf16, reference);
+            int decade = report;
+            while (decade >= 10) decade /= 10;
+            report = decade == 2 ? report/2*5 : report*2;
+        }
+    }
+    printf("ms/step          float %f, float16 %f, bfloat16 %f\n",
+        t[0]*1000/steps, t[1]*1000/steps, t[2]*1000/steps);
+}
+
+// Steps options.ensemble solvers together, each with its own value of the
+// swept parameter, and reports their combined throughput.
+template <typename T>
+int run_ensemble(const Options &options, ThreadPool &pool){
+    BasicEnsemble<T> ensemble(options.ensemble, options.nx, options.ny, &pool,
+        options.dt, options.iterations, options.vorticity);
+
+    int n = ensemble.size();
+    std::vector<float> values(n, 0.0f);
+    for (int i = 0; i < n; i++){
+        BasicFluidSolver<T> &member = ensemble[i];
+        configure(member, options);
+        float a = n > 1 ? float(i)/(n - 1) : 0.0f;
+        float value = values[i] = options.sweep_from + (options.sweep_to - options.sweep_from)*a;
+        switch (options.sweep){
+            case SWEEP_VORTICITY: member.vorticity = value; break;
+            case SWEEP_DT: member.dt = member.max_dt = value; break;
+            case SWEEP_BUOYANCY: member.buoyancy = value; break;
+            case SWEEP_ITERATIONS: member.iterations = values[i] = std::max(1, int(roundf(value))); break;
+            case SWEEP_NONE: break;
+        }
+    }
+
+    for (int i = 0; i < options.warmup; i++) ensemble.step();
+
+    long allocations = heap_allocations;
+    double t = sec();
+    for (int i = 0; i < options.steps; i++) ensemble.step();
+    double elapsed = sec() - t;
+    allocations = heap_allocations - allocations;
+
+    printf("grid             %i x %i\n", options.nx, options.ny);
+    printf("members          %i, %s\n", n, ensemble.across_members ?
+        "in runs across the threads" : "one at a time with all threads");
+    printf("steps            %i\n", options.steps);
+    printf("threads          %i\n", pool.size());
+    printf("simd             %s\n", n > 0 ? ensemble[0].simd->name : "-");
+    printf("storage          %s\n", storage_names[options.storage]);
+    printf("elapsed          %f s\n", elapsed);
+    printf("steps/sec        %f of the whole ensemble\n", options.steps/elapsed);
+    printf("cells/sec        %e of all members together\n", ensemble.cells()*options.steps/elapsed);
+    printf("ms/step          %f per member\n", elapsed*1000/options.steps/std::max(n, 1));
+    printf("heap allocations %li during timed steps\n", allocations);
+    printf("\n%8s %12s %14s\n", "member", sweep_names[options.sweep], "density sum");
+    for (int i = 0; i < n; i++){
+        printf("%8i %12g %14f\n", i, values[i], density_sum(ensemble[i]));
+    }
+    return 0;
+}
+
+template <typename T>
+int run(Options &options, ThreadPool &pool){
+    // the solver is created with the size of the checkpoint
+    CheckpointHeader restart_header;
+    if (options.restart){
+        if (!read_checkpoint_header(options.restart, restart_header)) return 1;
+        options.nx = restart_header.nx;
+        options.ny = restart_header.ny;
+        options.warmup = 0;
+    }
+
+    BasicFluidSolver<T> solver(options.nx, options.ny, options.dt, options.iterations, options.vorticity, &pool);
+    configure(solver, options);
+
+    double restart_time = 0.0;
+    if (options.restart){
+        double t = sec();
+        if (!load_checkpoint(solver, options.restart)) return 1;
+        restart_time = sec() - t;
+    }
+
+    // before the warmup, so the workers attach their counters there
+    if (options.perf && !perf_monitor.enable()) options.perf = false;
+
+    for (int i = 0; i < options.warmup; i++){
+        solver.step();
+    }
+    perf_monitor.phases.clear();
+
+    if (options.compare_pressure){
+        return compare_pressure(solver) ? 0 : 1;
+    }
+
+    FrameWriter writer;
+    writer.drop_when_full = options.drop_frames;
+    int record_w = options.record_w ? options.record_w : options.nx;
+    int record_h = options.record_h ? options.record_h : options.ny;
+    if (options.record && !writer.open(options.record, record_w, record_h)) return 1;
+    Colormap colors(options.palette);
+
+    ArchiveWriter archive;
+    if (options.archive && !archive.open(options.archive, options.nx, options.ny, 3, options.quantum)) return 1;
+
+    SharedFieldsWriter shared;
+    if (options.publish && !shared.open(options.publish, options.nx, options.ny, std::max(options.publish_slots, 1))) return 1;
+    double publish_time = 0.0;
+
+    double phases[4] = {0.0, 0.0, 0.0, 0.0};
+    double checkpoint_time = 0.0;
+    int checkpoints = 0;
+
+    long allocations = heap_allocations;
+    double t = sec();
+    double simulated = 0.0;
+    double active = 0.0;
+    bool record_tiles = record_w == options.nx && record_h == options.ny;
+    for (int i = 0; i < options.steps; i++){
+        simulated += solver.dt;
+        solver.step();
+        active += solver.density_tiles.fraction();
+        for (int j = 0; j < 4; j++) phases[j] += solver.timings[j];
+        if (writer.is_open()){
+            if (uint32_t *frame = writer.acquire()){
+                if (record_tiles){
+                    colors.apply(solver.density(), frame, solver.density_tiles, &pool, solver.simd);
+                } else {
+                    colors.apply(solver.density(), frame, record_w, record_h, &pool, solver.simd);
+                }
+                writer.submit();
+            }
+        }
+        if (archive.is_open() && options.archive_every > 0 && i % options.archive_every == 0){
+            const Grid<T> *fields[] = {&solver.old_density, &solver.old_u, &solver.old_v};
+            archive.submit(solver.frame, fields);
+        }
+        if (shared.is_open()){
+            double tp = sec();
+            shared.publish(solver.frame, solver.old_density, solver.old_u, solver.old_v);
+            publish_time += sec() - tp;
+        }
+        if (options.checkpoint && options.checkpoint_every > 0 && (i + 1) % options.checkpoint_every == 0 && i + 1 < options.steps){
+            double tc = sec();
+            save_checkpoint(solver, options.checkpoint);
+            checkpoint_time += sec() - tc;
+            checkpoints++;
+        }
+    }
+    double elapsed = sec() - t;
+    allocations = heap_allocations - allocations;
+    writer.close();
+    if (options.archive && !archive.close()) return 1;
+
+    if (options.checkpoint){
+        double tc = sec();
+        if (!save_checkpoint(solver, options.checkpoint)) return 1;
+        checkpoint_time += sec() - tc;
+        checkpoints++;
+    }
+
+    double cells = double(options.nx)*options.ny;
+
+    printf("grid             %i x %i\n", options.nx, options.ny);
+    printf("steps            %i\n", options.steps);
+    printf("threads          %i\n", pool.size());
+    printf("simd             %s\n", solver.simd->name);
+    printf("storage          %s\n", storage_names[options.storage]);
+    printf("elapsed          %f s\n", elapsed);
+    printf("steps/sec        %f\n", options.steps/elapsed);
+    printf("cells/sec        %e\n", cells*options.steps/elapsed);
+    printf("ms/step          %f\n", elapsed*1000/options.steps);
+    printf("simulated        %f s, %f times real time, dt %f on average\n",
+        simulated, simulated/elapsed, simulated/options.steps);
+    printf("  vorticity      %f\n", phases[0]/options.steps);
+    printf("  advect vel.    %f\n", phases[1]/options.steps);
+    printf("  project        %f\n", phases[2]/options.steps);
+    printf("  advect dens.   %f\n", phases[3]/options.steps);
+    if (options.sparse) printf("active tiles     %.1f%% of the density on average\n", active*100/options.steps);
+    printf("heap allocations %li during timed steps\n", allocations);
+    printf("density sum      %f\n", density_sum(solver));
+    if (options.record) writer.print_stats(stdout);
+    if (options.archive) archive.print_stats(stdout);
+    if (options.publish) printf("published        %i frames to %s, %f ms each\n", options.steps, options.publish, publish_time*1000/options.steps);
+    if (options.restart) printf("restart          %f ms from %s, frame %llu\n", restart_time*1000, options.restart, (unsigned long long)restart_header.frame);
+    if (options.checkpoint) printf("checkpoints      %i, %f ms each\n", checkpoints, checkpoint_time*1000/checkpoints);
+
+    if (options.perf){
+        printf("\n");
+        perf_monitor.report(stdout, cells);
+    }
+
+    if (options.trace){
+#ifdef FLUID_PROFILE
+        printf("\n");
+        profiler_report(options.trace);
+#else
+        printf("built without -DFLUID_PROFILE, no trace written\n");
+#endif
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv){
+    Options options;
+    if (!parse_options(options, argc, argv)){
+        usage(argv[0]);
+        return 1;
+    }
+
+    ThreadPool pool(options.threads);
+
+    if (options.compare_storage){
+        compare_storage(options, &pool);
+        return 0;
+    }
+
+    if (options.ensemble > 0){
+        switch (options.storage){
+            case STORAGE_FLOAT16: return run_ensemble<float16>(options, pool);
+            case STORAGE_BFLOAT16: return run_ensemble<bfloat16>(options, pool);
+            case STORAGE_FLOAT: break;
+        }
+        return run_ensemble<float>(options, pool);
+    }
+
+    switch (options.storage){
+        case STORAGE_FLOAT16: return run<float16>(options, pool);
+        case STORAGE_BFLOAT16: return run<bfloat16>(options, pool);
+        case STORAGE_FLOAT: break;
+    }
+    return run<float>(options, pool);
+}
@@ -0,0 +1,338 @@
+// Tests the shared memory publication of shared_fields.h: publishes frames
+// of density and velocity and has several reader processes follow them,
+// each checking every frame it reads against a checksum computed by the
+// writer. Reports the publishing cost and, per reader, the frames read,
+// missed because the ring had moved on, found torn by the seqlock, and the
+// latency from publication to the reader seeing the frame. With --attach
+// it follows another process instead, e.g. fluid_headless --publish /fluid.
+//
+// Build:
+//     g++ -O3 -march=native -pthread fluid_shared.cpp -o fluid_shared
+//     (add -lrt with glibc older than 2.17)
+//
+// Example:
+//     ./fluid_shared --nx 512 --ny 512 --frames 2000 --readers 2
+//     ./fluid_shared --solver --rate 60 --frames 300
+//     ./fluid_headless --steps 10000 --publish /fluid & ./fluid_shared --attach /fluid --seconds 5
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "fluid_solver.h"
+#include "shared_fields.h"
+
+struct Options {
+    int nx = 512;
+    int ny = 512;
+    int frames = 2000;
+    int readers = 2;
+    int slots = 4;
+    // frames per second, 0 for as fast as possible
+    float rate = 0.0f;
+    bool solver = false;
+    int threads = 1;
+    const char *name = "/fluid_shared_test";
+    const char *attach = NULL;
+    float seconds = 5.0f;
+};
+
+void usage(const char *name){
+    printf("Usage: %s [options]\n", name);
+    printf("    --nx N            grid width (default 512)\n");
+    printf("    --ny N            grid height (default 512)\n");
+    printf("    --frames N        frames to publish (default 2000)\n");
+    printf("    --readers N       reader processes (default 2)\n");
+    printf("    --slots N         frames kept in the segment (default 4)\n");
+    printf("    --rate F          frames per second, 0 for as fast as possible (default 0)\n");
+    printf("    --solver          publish the steps of a solver rather than synthetic frames\n");
+    printf("    --threads N       worker threads of the solver, 0 for all cores (default 1)\n");
+    printf("    --name NAME       shared memory segment (default /fluid_shared_test)\n");
+    printf("    --attach NAME     only read the segment NAME of another process\n");
+    printf("    --seconds F       how long to read with --attach (default 5)\n");
+}
+
+bool parse_options(Options &options, int argc, char **argv){
+    for (int i = 1; i < argc; i++){
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) return false;
+
+        if (strcmp(arg, "--solver") == 0){
+            options.solver = true;
+            continue;
+        }
+
+        if (!value){
+            printf("Missing value for %s\n", arg);
+            return false;
+        }
+
+        if      (strcmp(arg, "--nx"      ) == 0) options.nx      = atoi(value);
+        else if (strcmp(arg, "--ny"      ) == 0) options.ny      = atoi(value);
+        else if (strcmp(arg, "--frames"  ) == 0) options.frames  = atoi(value);
+        else if (strcmp(arg, "--readers" ) == 0) options.readers = atoi(value);
+        else if (strcmp(arg, "--slots"   ) == 0) options.slots   = atoi(value);
+        else if (strcmp(arg, "--rate"    ) == 0) options.rate    = atof(value);
+        else if (strcmp(arg, "--threads" ) == 0) options.threads = atoi(value);
+        else if (strcmp(arg, "--name"    ) == 0) options.name    = value;
+        else if (strcmp(arg, "--attach"  ) == 0) options.attach  = value;
+        else if (strcmp(arg, "--seconds" ) == 0) options.seconds = atof(value);
+        else {
+            printf("Unknown option %s\n", arg);
+            return false;
+        }
+        i++;
+    }
+
+    if (options.nx < 1 || options.ny < 1 || options.frames < 1 || options.readers < 1 || options.slots < 1){
+        printf("Invalid options\n");
+        return false;
+    }
+
+    return true;
+}
+
+// written by each reader into memory shared with the writer
+struct ReaderResult {
+    uint64_t seen;
+    uint64_t missed;
+    uint64_t torn;
+    uint64_t inconsistent;
+    double elapsed;
+    int64_t latency_p50;
+    int64_t latency_p99;
+    int64_t latency_max;
+};
+
+struct Control {
+    std::atomic<int> ready;
+    std::atomic<int> done;
+};
+
+template <typename T>
+T* map_shared(size_t count){
+    void *p = mmap(nullptr, count*sizeof(T), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? nullptr : (T*)p;
+}
+
+// of the three fields one after another, in the order of the segment
+double checksum(const float *fields, size_t n){
+    double sum = 0.0;
+    for (size_t i = 0; i < n; i++) sum += fields[i];
+    return sum;
+}
+
+double checksum(const Grid<float> &density, const Grid<float> &u, const Grid<float> &v){
+    double sum = 0.0;
+    const Grid<float> *fields[] = {&density, &u, &v};
+    for (const Grid<float> *field : fields){
+        for (int y = 0; y < field->ny; y++){
+            const float *row = field->row(y);
+            for (int x = 0; x < field->nx; x++) sum += row[x];
+        }
+    }
+    return sum;
+}
+
+// Follows the frames from next on until stop() says so, reading each in
+// place. The frame k is checked against sums[k] if sums is not null.
+template <typename F>
+void follow(const SharedFieldsReader &reader, uint64_t next, const double *sums, ReaderResult &result, F stop){
+    size_t n = size_t(reader.nx)*reader.ny;
+    uint64_t slots = reader.header->slots;
+    std::vector<int64_t> latencies;
+    double t = sec();
+    while (true){
+        uint64_t published = reader.published();
+        if (next == published){
+            if (stop()) break;
+            sched_yield();
+            continue;
+        }
+        if (published - next > slots){
+            result.missed += published - slots - next;
+            next = published - slots;
+        }
+        SharedFieldsView view;
+        if (!reader.view(next, view)){
+            result.missed++;
+            next++;
+            continue;
+        }
+        int64_t latency = monotonic_ns() - view.publish_ns;
+        double sum = checksum(view.density, 3*n);
+        if (!reader.still_valid(view)){
+            result.torn++;
+        } else {
+            if (sums && sum != sums[next]) result.inconsistent++;
+            result.seen++;
+            latencies.push_back(latency);
+        }
+        next++;
+    }
+    result.elapsed = sec() - t;
+    if (!latencies.empty()){
+        std::sort(latencies.begin(), latencies.end());
+        result.latency_p50 = latencies[latencies.size()/2];
+        result.latency_p99 = latencies[latencies.size()*99/100];
+        result.latency_max = latencies.back();
+    }
+}
+
+void print_header(){
+    printf("\n%6s %9s %9s %6s %13s %9s %9s %9s %9s\n",
+        "reader", "seen", "missed", "torn", "inconsistent", "frames/s", "p50 us", "p99 us", "max us");
+}
+
+void print_result(int reader, const ReaderResult &r){
+    printf("%6i %9llu %9llu %6llu %13llu %9.0f %9.1f %9.1f %9.1f\n", reader,
+        (unsigned long long)r.seen, (unsigned long long)r.missed,
+        (unsigned long long)r.torn, (unsigned long long)r.inconsistent,
+        r.elapsed > 0.0 ? r.seen/r.elapsed : 0.0,
+        r.latency_p50*1e-3, r.latency_p99*1e-3, r.latency_max*1e-3);
+}
+
+int attach(const Options &options){
+    SharedFieldsReader reader;
+    double deadline = sec() + options.seconds;
+    while (!reader.open(options.attach)){
+        if (sec() > deadline){
+            printf("Could not open shared memory %s\n", options.attach);
+            return 1;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    printf("grid             %i x %i, %.1f MB per frame\n", reader.nx, reader.ny,
+        SHARED_FIELDS_CHANNELS*reader.nx*reader.ny*sizeof(float)*1e-6);
+    printf("slots            %i\n", reader.header->slots);
+
+    ReaderResult result = {};
+    follow(reader, reader.published(), nullptr, result, [&](){ return sec() > deadline; });
+    print_header();
+    print_result(0, result);
+    return 0;
+}
+
+int main(int argc, char **argv){
+    Options options;
+    if (!parse_options(options, argc, argv)){
+        usage(argv[0]);
+        return 1;
+    }
+    if (options.attach) return attach(options);
+
+    int nx = options.nx;
+    int ny = options.ny;
+    double frame_bytes = SHARED_FIELDS_CHANNELS*double(nx)*ny*sizeof(float);
+    printf("grid             %i x %i, %.1f MB per frame\n", nx, ny, frame_bytes*1e-6);
+    printf("slots            %i\n", options.slots);
+    printf("frames           %i %s, ", options.frames, options.solver ? "solver steps" : "synthetic");
+    if (options.rate > 0.0f) printf("%g per second\n", options.rate);
+    else printf("as fast as possible\n");
+    printf("readers          %i\n", options.readers);
+
+    Control *control = map_shared<Control>(1);
+    ReaderResult *results = map_shared<ReaderResult>(options.readers);
+    double *sums = map_shared<double>(options.frames);
+    if (!control || !results || !sums){
+        printf("Could not map shared memory\n");
+        return 1;
+    }
+    memset(results, 0, options.readers*sizeof(ReaderResult));
+    control->ready.store(0);
+    control->done.store(0);
+
+    SharedFieldsWriter writer;
+    if (!writer.open(options.name, nx, ny, options.slots)) return 1;
+
+    fflush(stdout);
+    std::vector<pid_t> pids;
+    for (int r = 0; r < options.readers; r++){
+        pid_t pid = fork();
+        if (pid == 0){
+            SharedFieldsReader reader;
+            if (!reader.open(options.name)){
+                printf("Reader %i could not open shared memory %s\n", r, options.name);
+                _exit(1);
+            }
+            control->ready.fetch_add(1);
+            follow(reader, 0, sums, results[r], [&](){
+                return control->done.load(std::memory_order_acquire) != 0;
+            });
+            fflush(stdout);
+            _exit(0);
+        }
+        if (pid < 0){
+            printf("Could not fork reader %i\n", r);
+            for (pid_t p : pids) kill(p, SIGKILL);
+            for (pid_t p : pids) waitpid(p, nullptr, 0);
+            return 1;
+        }
+        pids.push_back(pid);
+    }
+    while (control->ready.load() < options.readers) sched_yield();
+
+    ThreadPool pool(options.threads);
+    FluidSolver solver(nx, ny, 0.02f, 5, 10.0f, &pool);
+    Grid<float> density(nx, ny), u(nx, ny), v(nx, ny);
+
+    double publish_time = 0.0;
+    double t = sec();
+    for (int k = 0; k < options.frames; k++){
+        if (options.rate > 0.0f){
+            double due = t + k/options.rate;
+            if (sec() < due) std::this_thread::sleep_for(std::chrono::duration<double>(due - sec()));
+        }
+        uint64_t frame = k;
+        const Grid<float> *fields[3] = {&density, &u, &v};
+        if (options.solver){
+            solver.step();
+            frame = solver.frame;
+            fields[0] = &solver.old_density;
+            fields[1] = &solver.old_u;
+            fields[2] = &solver.old_v;
+        } else {
+            density.fill(float(k));
+            u.fill(k + 0.5f);
+            v.fill(-float(k));
+        }
+        // before publishing, a reader may check the frame right away
+        sums[k] = checksum(*fields[0], *fields[1], *fields[2]);
+
+        double tp = sec();
+        writer.publish(frame, *fields[0], *fields[1], *fields[2]);
+        publish_time += sec() - tp;
+    }
+    double elapsed = sec() - t;
+    control->done.store(1, std::memory_order_release);
+
+    bool ok = true;
+    for (pid_t pid : pids){
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) ok = false;
+    }
+    writer.close();
+
+    printf("\npublish          %f ms per frame, %.2f GB/s\n",
+        publish_time*1000/options.frames, frame_bytes*options.frames/publish_time*1e-9);
+    printf("writer           %.0f frames/s\n", options.frames/elapsed);
+    print_header();
+    for (int r = 0; r < options.readers; r++){
+        print_result(r, results[r]);
+        if (results[r].inconsistent > 0) ok = false;
+    }
+    if (!ok) printf("\nFAILED\n");
+    return ok ? 0 : 1;
+}
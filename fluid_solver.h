@@ -0,0 +1,851 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <type_traits>
+#include <vector>
+#include "vec2.h"
+#include "grid.h"
+#include "timer.h"
+#include "thread_pool.h"
+#include "multigrid.h"
+#include "fft.h"
+#include "workspace.h"
+#include "simd.h"
+#include "half.h"
+#include "philox.h"
+#include "checkpoint.h"
+#include "profiler.h"
+#include "active_tiles.h"
+
+float sign(float x){
+    return
+        x > 0.0f ? +1.0f :
+        x < 0.0f ? -1.0f :
+        0.0f;
+}
+
+// density added in a disc of radius r around (x, y), see add_density()
+struct Splat {
+    int x, y, r;
+    float value;
+};
+
+enum PressureMethod {
+    PRESSURE_JACOBI,
+    PRESSURE_MULTIGRID,
+    PRESSURE_FFT,
+    PRESSURE_SOR,
+};
+
+// Velocity and density are stored as T: float, or float16 or bfloat16 for
+// half the memory traffic at lower precision. The passes compute in float
+// and the pressure solve runs on float grids either way.
+template <typename T>
+struct BasicFluidSolver {
+    int nx, ny;
+    // Row y of the grids is row y + y_offset, mod domain_ny, of the domain
+    // being simulated, which is larger when this solver computes one slab
+    // of it, see slab_solver.h. The forcing and the cleared bottom rows
+    // depend on it.
+    int y_offset = 0;
+    int domain_ny;
+
+    // of the next step
+    float dt;
+    int iterations;
+    float vorticity;
+
+    // With cfl > 0, each step picks the dt of the next one so that the
+    // fastest cell moves cfl cells, within [min_dt, max_dt].
+    float cfl = 0.0f;
+    float min_dt = 0.001f;
+    float max_dt = 0.02f;
+
+    // density is added here every step, e.g. below the mouse cursor
+    vec2f mouse;
+
+    // velocity as separate planes of x (u) and y (v) components
+    Grid<T> old_u, old_v;
+    Grid<T> new_u, new_v;
+
+    Grid<T> old_density;
+    Grid<T> new_density;
+
+    // milliseconds of vorticity, advect velocity, project, advect density
+    double timings[4];
+
+    // passes run serially if null
+    ThreadPool *pool;
+
+    // kernels of the widest instruction set the CPU supports
+    const SimdKernels<T> *simd;
+
+    PressureMethod pressure = PRESSURE_JACOBI;
+    // Jacobi iterations done per pass over the grid while a band of
+    // jacobi_tile_rows rows stays in cache, 1 for one iteration per pass
+    int jacobi_time_block = 5;
+    int jacobi_tile_rows = 32;
+    // relaxation factor of red-black SOR, 1 is Gauss-Seidel, which does best
+    // for a handful of sweeps; many sweeps want 2/(1 + sin(pi/n))
+    float sor_omega = 1.0f;
+    // cycles per step and 1 for V-cycles or 2 for W-cycles
+    int multigrid_cycles = 2;
+    int multigrid_gamma = 1;
+
+    // terms of the forcing pass at the start of each step, a sum is disabled
+    // by 0 and a factor by 1
+    // amplitude of the random velocity in the left half
+    float noise = 10.0f;
+    // the noise of a cell depends only on seed, frame and its coordinates
+    uint32_t seed = 1;
+    // steps since reset()
+    uint64_t frame = 0;
+    // dense regions rise up, v += (density*buoyancy - gravity)*dt
+    float buoyancy = 20.0f;
+    float gravity = 5.0f;
+    // fast movement is dampened
+    float damping = 0.999f;
+    // density fades away
+    float fade = 0.99f;
+    // rows at the bottom which are cleared at the end of each step
+    int bottom_rows = 10;
+
+    // With sparse set, density advection only computes the tiles holding
+    // density above sparse_threshold, grown by the distance it can move in
+    // one step, and clears the others; above sparse_max_fraction active
+    // tiles it runs dense. Noise and gravity act on every cell, so the
+    // velocity is never quiescent and its passes always run dense.
+    bool sparse = false;
+    float sparse_threshold = 1e-4f;
+    float sparse_max_fraction = 0.5f;
+    // tiles of the density left by the last step, all of them unless sparse
+    ActiveTiles density_tiles;
+    // largest density in each tile column of each row, left by the forcing pass
+    std::vector<float> tile_row_maxima;
+    bool tile_row_maxima_valid = false;
+
+    // scratch grids of the passes, reused across steps; own_workspace
+    // unless several solvers which step one at a time share one, see
+    // Ensemble in ensemble.h
+    Workspace own_workspace;
+    Workspace *workspace;
+
+    // created on first use
+    Multigrid *multigrid = nullptr;
+    FftPoisson *fft_poisson = nullptr;
+
+    // loaded checkpoint, grids which do not own their memory point into it
+    MappedFile checkpoint_file;
+
+    BasicFluidSolver(
+        int nx, int ny,
+        float dt = 0.02f,
+        int iterations = 5,
+        float vorticity = 10.0f,
+        ThreadPool *pool = nullptr
+    ):
+        nx(nx), ny(ny),
+        domain_ny(ny),
+        dt(dt),
+        iterations(iterations),
+        vorticity(vorticity),
+        mouse{0.0f, 0.0f},
+        old_u(nx, ny), old_v(nx, ny),
+        new_u(nx, ny), new_v(nx, ny),
+        old_density(nx, ny),
+        new_density(nx, ny),
+        pool(pool),
+        simd(get_simd_kernels<T>()),
+        density_tiles(nx, ny),
+        tile_row_maxima(ny*density_tiles.tiles_x),
+        workspace(&own_workspace)
+    {
+        reset();
+    }
+
+    ~BasicFluidSolver(){
+        delete multigrid;
+        delete fft_poisson;
+    }
+
+    void reset(){
+        old_density.fill(0.0f);
+        old_u.fill(0.0f);
+        old_v.fill(0.0f);
+        frame = 0;
+        for (int i = 0; i < 4; i++) timings[i] = 0.0;
+    }
+
+    // Saves everything step() depends on: the fields, the frame counter
+    // of the noise and the parameters, but not the choice of pressure
+    // solver, which is up to whoever resumes.
+    bool save_checkpoint(const char *path) const {
+        static_assert(std::is_same<T, float>::value, "checkpoints hold float grids");
+        CheckpointHeader header;
+        memset(&header, 0, sizeof(header));
+        header.nx = nx;
+        header.ny = ny;
+        header.stride = old_u.stride;
+        header.left_padding = Grid<float>::left_padding();
+        header.frame = frame;
+        header.seed = seed;
+        header.iterations = iterations;
+        header.dt = dt;
+        header.vorticity = vorticity;
+        header.mouse_x = mouse.x;
+        header.mouse_y = mouse.y;
+        header.noise = noise;
+        header.buoyancy = buoyancy;
+        header.gravity = gravity;
+        header.damping = damping;
+        header.fade = fade;
+        header.bottom_rows = bottom_rows;
+        checkpoint_layout(header);
+
+        const Grid<float> *fields[CHECKPOINT_FIELDS] = {&old_u, &old_v, &old_density};
+        return write_checkpoint(path, header, fields);
+    }
+
+    // Resumes from a checkpoint of a grid of the same size. The fields are
+    // mapped rather than read where the platform and row layout allow it.
+    bool load_checkpoint(const char *path){
+        static_assert(std::is_same<T, float>::value, "checkpoints hold float grids");
+        CheckpointHeader header;
+        if (!read_checkpoint_header(path, header)) return false;
+        if (header.nx != nx || header.ny != ny){
+            printf("%s is a %i x %i grid, not %i x %i\n", path, header.nx, header.ny, nx, ny);
+            return false;
+        }
+
+        // the grids may still point into a previous checkpoint
+        Grid<float> *grids[] = {&old_u, &old_v, &old_density, &new_u, &new_v, &new_density};
+        for (Grid<float> *grid : grids){
+            if (grid->owner) continue;
+            Grid<float> owned(nx, ny);
+            grid->swap(owned);
+        }
+        checkpoint_file.unmap();
+
+        Grid<float> *fields[CHECKPOINT_FIELDS] = {&old_u, &old_v, &old_density};
+        bool same_layout = header.stride == old_u.stride && header.left_padding == Grid<float>::left_padding();
+        if (same_layout && checkpoint_file.map(path)){
+            for (int i = 0; i < CHECKPOINT_FIELDS; i++){
+                Grid<float> mapped(nx, ny, (float*)(checkpoint_file.data + header.field_offsets[i]));
+                fields[i]->swap(mapped);
+            }
+        } else if (!read_checkpoint_fields(path, header, fields)){
+            printf("Could not read %s\n", path);
+            return false;
+        }
+
+        frame = header.frame;
+        seed = header.seed;
+        iterations = header.iterations;
+        dt = header.dt;
+        vorticity = header.vorticity;
+        mouse = vec2f{header.mouse_x, header.mouse_y};
+        noise = header.noise;
+        buoyancy = header.buoyancy;
+        gravity = header.gravity;
+        damping = header.damping;
+        fade = header.fade;
+        bottom_rows = header.bottom_rows;
+        for (int i = 0; i < 4; i++) timings[i] = 0.0;
+        return true;
+    }
+
+    // Calls f(x, y) for every cell, rows are distributed over the pool.
+    // Every pass ends with fill_halo() on the grids it wrote, so the next
+    // pass can read one cell past the border without wrapping.
+    template <typename F>
+    void for_each_cell(F f){
+        parallel_for(pool, 0, ny, [&](int y0, int y1){
+            for (int y = y0; y < y1; y++) for (int x = 0; x < nx; x++) f(x, y);
+        });
+    }
+
+    const Grid<T>& density() const {
+        return old_density;
+    }
+
+    const Grid<T>& velocity_x() const {
+        return old_u;
+    }
+
+    const Grid<T>& velocity_y() const {
+        return old_v;
+    }
+
+    vec2f velocity(int x, int y) const {
+        return vec2f{old_u(x, y), old_v(x, y)};
+    }
+
+    void swap_velocity(){
+        old_u.swap(new_u);
+        old_v.swap(new_v);
+    }
+
+    void fill_velocity_halo(){
+        old_u.fill_halo();
+        old_v.fill_halo();
+    }
+
+    // Largest speed of any cell. Each thread takes one run of rows, as in
+    // jacobi_blocked(), and leaves its maximum in the workspace.
+    float max_speed(){
+        int num_runs = std::min(pool ? pool->size() : 1, ny);
+        float *maxima = (float*)workspace->push(num_runs*sizeof(float));
+        parallel_for(pool, 0, num_runs, [&](int r0, int r1){
+            for (int run = r0; run < r1; run++){
+                maxima[run] = simd->max_speed2(old_u, old_v, run*ny/num_runs, (run + 1)*ny/num_runs, 0, nx);
+            }
+        }, 1);
+        float m = *std::max_element(maxima, maxima + num_runs);
+        workspace->pop();
+        return sqrtf(m);
+    }
+
+    // time step in which the fastest cell moves cfl cells, within [min_dt, max_dt]
+    float cfl_dt(){
+        PROFILE_SCOPE("cfl_dt");
+        PERF_SCOPE("cfl_dt");
+        float speed = max_speed();
+        float t = speed > 0.0f ? cfl/speed : max_dt;
+        return clamp(t, min_dt, max_dt);
+    }
+
+    // Calls f(y0, y1) for bands of rows, for the SIMD kernels.
+    template <typename F>
+    void for_each_band(F f){
+        parallel_for(pool, 0, ny, f);
+    }
+
+    // Marks the tiles whose density exceeds sparse_threshold after the
+    // forcing pass and grows them by the distance the density moves in one
+    // step, or sets all of them.
+    void update_density_tiles(){
+        ActiveTiles &tiles = density_tiles;
+        if (!sparse || !tile_row_maxima_valid){
+            tiles.set_dense();
+            return;
+        }
+        tile_row_maxima_valid = false;
+
+        for (int ty = 0; ty < tiles.tiles_y; ty++) for (int tx = 0; tx < tiles.tiles_x; tx++){
+            float m = 0.0f;
+            int y1 = std::min((ty + 1)*tiles.tile, ny);
+            for (int y = ty*tiles.tile; y < y1; y++){
+                m = std::max(m, tile_row_maxima[tx + y*tiles.tiles_x]);
+            }
+            tiles.mask[tx + ty*tiles.tiles_x] = m > sparse_threshold;
+        }
+
+        // the bilinear taps reach one cell past the traced back position
+        float reach = max_speed()*dt + 1.0f;
+        float limit = std::max(nx, ny);
+        if (!(reach < limit)) reach = limit;
+        tiles.dilate(int(ceilf(reach/tiles.tile)));
+        tiles.finish(sparse_max_fraction);
+    }
+
+    void advect_density(){
+        PROFILE_SCOPE("advect_density");
+        PERF_SCOPE("advect_density");
+        const Grid<T> *src[] = {&old_density};
+        Grid<T> *dst[] = {&new_density};
+        update_density_tiles();
+        const ActiveTiles &tiles = density_tiles;
+        if (tiles.dense){
+            for_each_band([&](int y0, int y1){
+                simd->advect(old_u, old_v, dt, 1, src, dst, y0, y1, 0, nx);
+            });
+        } else {
+            // nothing reaches the other tiles
+            parallel_for(pool, 0, tiles.size(), [&](int i0, int i1){
+                for (int i = i0; i < i1; i++){
+                    int x0, x1, y0, y1;
+                    tiles.bounds(i, x0, x1, y0, y1);
+                    if (tiles.mask[i]){
+                        simd->advect(old_u, old_v, dt, 1, src, dst, y0, y1, x0, x1);
+                        continue;
+                    }
+                    for (int y = y0; y < y1; y++){
+                        std::fill(new_density.row(y) + x0, new_density.row(y) + x1, T(0.0f));
+                    }
+                }
+            }, 1);
+        }
+        new_density.fill_halo();
+        old_density.swap(new_density);
+    }
+
+    void advect_velocity(){
+        PROFILE_SCOPE("advect_velocity");
+        PERF_SCOPE("advect_velocity");
+        // both components are traced back along the same path
+        const Grid<T> *src[] = {&old_u, &old_v};
+        Grid<T> *dst[] = {&new_u, &new_v};
+        for_each_band([&](int y0, int y1){
+            simd->advect(old_u, old_v, dt, 2, src, dst, y0, y1, 0, nx);
+        });
+        new_u.fill_halo();
+        new_v.fill_halo();
+        swap_velocity();
+    }
+
+    void diffuse_density(){
+        float diffusion = dt*100.01f;
+        for_each_cell([&](int x, int y){
+            float sum =
+                diffusion*(
+                + old_density(x - 1, y + 0)
+                + old_density(x + 1, y + 0)
+                + old_density(x + 0, y - 1)
+                + old_density(x + 0, y + 1)
+                )
+                + old_density(x + 0, y + 0);
+            new_density(x, y) = 1.0f/(1.0f + 4.0f*diffusion) * sum;
+        });
+        new_density.fill_halo();
+        old_density.swap(new_density);
+    }
+
+    void diffuse_velocity(){
+        float viscosity = dt*0.000001f;
+        for_each_cell([&](int x, int y){
+            vec2f sum =
+                viscosity*(
+                + velocity(x - 1, y + 0)
+                + velocity(x + 1, y + 0)
+                + velocity(x + 0, y - 1)
+                + velocity(x + 0, y + 1)
+                )
+                + velocity(x + 0, y + 0);
+            sum = 1.0f/(1.0f + 4.0f*viscosity) * sum;
+            new_u(x, y) = sum.x;
+            new_v(x, y) = sum.y;
+        });
+        new_u.fill_halo();
+        new_v.fill_halo();
+        swap_velocity();
+    }
+
+    void compute_divergence(Grid<float> &div){
+        PROFILE_SCOPE("divergence");
+        PERF_SCOPE("divergence");
+        for_each_band([&](int y0, int y1){
+            simd->divergence(old_u, old_v, div, y0, y1, 0, nx);
+        });
+        div.fill_halo();
+    }
+
+    // p has to be a ScratchGrid, it is swapped with another one
+    void jacobi(Grid<float> &p, const Grid<float> &div, int iterations){
+        ScratchGrid<float> p2(*workspace, nx, ny);
+        bool swapped = false;
+
+        for (int k = 0; k < iterations;){
+            int depth = std::min(std::max(jacobi_time_block, 1), iterations - k);
+            if (depth == 1){
+                for_each_band([&](int y0, int y1){
+                    simd->jacobi(p, div, p2, y0, y1, 0, nx);
+                });
+            } else {
+                jacobi_blocked(p, div, p2, depth);
+            }
+            p2.fill_halo();
+            p.swap(p2);
+            swapped = !swapped;
+            k += depth;
+        }
+
+        // p must not keep the scratch memory, which is popped on return
+        if (swapped){
+            p.swap(p2);
+            memcpy(p.memory, p2.memory, Grid<float>::storage_size(nx, ny));
+        }
+    }
+
+    // Writes depth Jacobi iterations of p to p2 in one pass. Each tile of
+    // rows is iterated in two small buffers with depth extra rows on both
+    // sides, one row fewer on each side per iteration, so p, div and p2 go
+    // through memory only once. The extra rows are computed by both
+    // neighbouring tiles, which costs about depth/tile_rows more arithmetic
+    // and gives the same result.
+    void jacobi_blocked(const Grid<float> &p, const Grid<float> &div, Grid<float> &p2, int depth){
+        int tile_rows = std::max(jacobi_tile_rows, 1);
+        int rows = tile_rows + 2*depth;
+        int num_tiles = (ny + tile_rows - 1)/tile_rows;
+        size_t bytes = Grid<float>::storage_size(nx, rows);
+
+        // one contiguous run of tiles and one set of buffers per thread,
+        // two for the iterations and two for tiles which wrap around
+        int num_runs = std::min(pool ? pool->size() : 1, num_tiles);
+        char *memory = (char*)workspace->push(4*bytes*num_runs);
+
+        parallel_for(pool, 0, num_runs, [&](int r0, int r1){
+            for (int run = r0; run < r1; run++){
+                float *buffers[4];
+                for (int i = 0; i < 4; i++) buffers[i] = (float*)(memory + (4*run + i)*bytes);
+
+                int t0 = run*num_tiles/num_runs;
+                int t1 = (run + 1)*num_tiles/num_runs;
+                for (int t = t0; t < t1; t++){
+                    int y0 = t*tile_rows;
+                    int y1 = std::min(y0 + tile_rows, ny);
+                    jacobi_tile(p, div, p2, depth, y0, y1, buffers);
+                }
+            }
+        }, 1);
+
+        workspace->pop();
+    }
+
+    // grid of the given number of rows whose row i is row y0 + i of grid,
+    // rows -1 and rows have to exist in grid, its memory is not copied
+    static Grid<float> row_view(const Grid<float> &grid, int y0, int rows){
+        return Grid<float>(grid.nx, rows, (float*)grid.row(y0 - 1) - Grid<float>::left_padding());
+    }
+
+    // rows [y0, y1) of jacobi_blocked(), row i of the buffers is row
+    // y0 - depth + i of the grid
+    void jacobi_tile(
+        const Grid<float> &p, const Grid<float> &div, Grid<float> &p2, int depth,
+        int y0, int y1, float *const *buffers
+    ){
+        int rows = jacobi_tile_rows + 2*depth;
+        int local_rows = y1 - y0 + 2*depth;
+        int top = y0 - depth;
+
+        Grid<float> a(nx, rows, buffers[0]);
+        Grid<float> b(nx, rows, buffers[1]);
+
+        // the first iteration reads p and div in place unless the tile wraps
+        // around, the solver grids are periodic
+        bool inside = top >= 0 && top + local_rows <= ny;
+        Grid<float> p_tile = inside ? row_view(p, top, rows) : Grid<float>(nx, rows, buffers[2]);
+        Grid<float> d_tile = inside ? row_view(div, top, rows) : Grid<float>(nx, rows, buffers[3]);
+        if (!inside){
+            for (int i = 0; i < local_rows; i++){
+                int y = Periodic::map(top + i, ny);
+                memcpy(p_tile.row(i) - 1, p.row(y) - 1, (nx + 2)*sizeof(float));
+                memcpy(d_tile.row(i) - 1, div.row(y) - 1, (nx + 2)*sizeof(float));
+            }
+        }
+
+        const Grid<float> *src = &p_tile;
+        Grid<float> *dst = &a;
+        for (int k = 1; k < depth; k++){
+            simd->jacobi(*src, d_tile, *dst, k, local_rows - k, 0, nx);
+            for (int i = k; i < local_rows - k; i++){
+                float *r = dst->row(i);
+                r[-1] = r[nx - 1];
+                r[nx] = r[0];
+            }
+            src = dst;
+            dst = dst == &a ? &b : &a;
+        }
+
+        // the last iteration writes to p2 directly unless the tile wraps around
+        if (inside){
+            Grid<float> out = row_view(p2, top, rows);
+            simd->jacobi(*src, d_tile, out, depth, local_rows - depth, 0, nx);
+        } else {
+            simd->jacobi(*src, d_tile, *dst, depth, local_rows - depth, 0, nx);
+            for (int y = y0; y < y1; y++){
+                memcpy(p2.row(y), dst->row(y - top), nx*sizeof(float));
+            }
+        }
+    }
+
+    // Updates p in place, first all cells with even x + y, then all odd ones.
+    // Cells of one color only read the other color, so each half sweep is
+    // parallel and no second buffer is needed.
+    void red_black_sor(Grid<float> &p, const Grid<float> &div, int iterations, float omega){
+        // with odd sizes, cells of the same color touch across the wrap around
+        ThreadPool *pool = nx % 2 == 0 && ny % 2 == 0 ? this->pool : nullptr;
+
+        for (int k = 0; k < iterations; k++){
+            for (int color = 0; color < 2; color++){
+                parallel_for(pool, 0, ny, [&](int y0, int y1){
+                    for (int y = y0; y < y1; y++){
+                        for (int x = (y + color) & 1; x < nx; x += 2){
+                            float sum = -div(x, y)
+                                + p(x + 1, y + 0)
+                                + p(x - 1, y + 0)
+                                + p(x + 0, y + 1)
+                                + p(x + 0, y - 1);
+                            p(x, y) += omega*(0.25f*sum - p(x, y));
+                        }
+                    }
+                });
+                p.fill_halo();
+            }
+        }
+    }
+
+    Multigrid& get_multigrid(){
+        if (!multigrid) multigrid = new Multigrid(nx, ny);
+        multigrid->pool = pool;
+        multigrid->gamma = multigrid_gamma;
+        return *multigrid;
+    }
+
+    FftPoisson& get_fft_poisson(){
+        if (!fft_poisson) fft_poisson = new FftPoisson(nx, ny);
+        fft_poisson->pool = pool;
+        return *fft_poisson;
+    }
+
+    // solves the periodic Poisson equation for p, the iterative methods
+    // approximately and starting from p
+    void solve_pressure(Grid<float> &p, const Grid<float> &div){
+        PROFILE_SCOPE("solve_pressure");
+        PERF_SCOPE("solve_pressure");
+        switch (pressure){
+            case PRESSURE_JACOBI:
+                jacobi(p, div, iterations);
+                break;
+            case PRESSURE_MULTIGRID:
+                get_multigrid().solve(p, div, multigrid_cycles);
+                break;
+            case PRESSURE_FFT:
+                get_fft_poisson().solve(p, div);
+                break;
+            case PRESSURE_SOR:
+                red_black_sor(p, div, iterations, sor_omega);
+                break;
+        }
+    }
+
+    void subtract_pressure_gradient(const Grid<float> &p){
+        PROFILE_SCOPE("subtract_gradient");
+        PERF_SCOPE("subtract_gradient");
+        for_each_band([&](int y0, int y1){
+            simd->subtract_gradient(p, old_u, old_v, y0, y1, 0, nx);
+        });
+        fill_velocity_halo();
+    }
+
+    void project_velocity(){
+        PROFILE_SCOPE("project_velocity");
+        PERF_SCOPE("project_velocity");
+        ScratchGrid<float> p(*workspace, nx, ny);
+        ScratchGrid<float> div(*workspace, nx, ny);
+
+        compute_divergence(div);
+
+        p.fill(0.0f);
+
+        solve_pressure(p, div);
+
+        subtract_pressure_gradient(p);
+    }
+
+    void vorticity_confinement(){
+        PROFILE_SCOPE("vorticity_confinement");
+        PERF_SCOPE("vorticity_confinement");
+        ScratchGrid<float> abs_curl(*workspace, nx, ny);
+
+        for_each_band([&](int y0, int y1){
+            simd->abs_curl(old_u, old_v, abs_curl, y0, y1, 0, nx);
+        });
+        abs_curl.fill_halo();
+
+        for_each_band([&](int y0, int y1){
+            simd->confine_vorticity(old_u, old_v, abs_curl, new_u, new_v, dt, vorticity, y0, y1, 0, nx);
+        });
+        new_u.fill_halo();
+        new_v.fill_halo();
+
+        swap_velocity();
+    }
+
+    // row of the domain which row y of the grids holds
+    int domain_row(int y) const {
+        return Periodic::map(y + y_offset, domain_ny);
+    }
+
+    // adds the part of the splat which lands in row y of the domain, in
+    // the same order as add_density(), so both give the same sums where
+    // the disc wraps
+    void add_splat_row(float *row, const Splat &splat, int y){
+        int r = splat.r;
+        for (int dy = -r; dy <= r; dy++){
+            if (Periodic::map(splat.y + dy, domain_ny) != y) continue;
+            for (int dx = -r; dx <= r; dx++){
+                float d = sqrtf(dx*dx + dy*dy);
+                float u = smoothstep(float(r), 0.0f, d);
+                row[Periodic::map(splat.x + dx, nx)] += u*splat.value;
+            }
+        }
+    }
+
+    // random velocity in [-noise, noise) added to cells x < x1 of row y of
+    // the domain
+    void add_noise_row(float *u, float *v, int y, int x1){
+        // locals, the stores through u and v could alias members
+        float noise = this->noise;
+        uint32_t seed = this->seed;
+        uint32_t frame_lo = uint32_t(frame);
+        uint32_t frame_hi = uint32_t(frame >> 32);
+        for (int x = 0; x < x1; x++){
+            Philox r = philox4x32(Philox{{uint32_t(x), uint32_t(y), frame_lo, frame_hi}}, seed, 0);
+            u[x] += lerp(-noise, +noise, philox_uniform(r.v[0]));
+            v[x] += lerp(-noise, +noise, philox_uniform(r.v[1]));
+        }
+    }
+
+    // Noise, buoyancy, damping, fade and the density sources in one sweep
+    // over the grid. Splats in before are added after buoyancy has read the
+    // density and before it fades, the ones in after are added last.
+    void apply_forcing(const Splat *before, int num_before, const Splat *after, int num_after){
+        PROFILE_SCOPE("forcing");
+        PERF_SCOPE("forcing");
+        if constexpr (std::is_same<T, float>::value){
+            for_each_band([&](int y0, int y1){
+                forcing_rows(y0, y1, nullptr, before, num_before, after, num_after);
+            });
+        } else {
+            // one contiguous run of rows and one set of float rows per thread,
+            // as in jacobi_blocked()
+            int num_runs = std::min(pool ? pool->size() : 1, ny);
+            float *memory = (float*)workspace->push(3*nx*num_runs*sizeof(float));
+            parallel_for(pool, 0, num_runs, [&](int r0, int r1){
+                for (int run = r0; run < r1; run++){
+                    int y0 = run*ny/num_runs;
+                    int y1 = (run + 1)*ny/num_runs;
+                    forcing_rows(y0, y1, memory + 3*nx*run, before, num_before, after, num_after);
+                }
+            }, 1);
+            workspace->pop();
+        }
+        fill_velocity_halo();
+        old_density.fill_halo();
+        tile_row_maxima_valid = sparse;
+    }
+
+    // rows [y0, y1) of apply_forcing(), 16 bit rows are converted to 3*nx
+    // floats in buffer and back
+    void forcing_rows(
+        int y0, int y1, float *buffer,
+        const Splat *before, int num_before, const Splat *after, int num_after
+    ){
+        // the left half including the middle column
+        int noise_end = std::min(nx, nx/2 + 1);
+        for (int y = y0; y < y1; y++){
+            int row = domain_row(y);
+            float *u, *v, *density;
+            if constexpr (std::is_same<T, float>::value){
+                u = old_u.row(y);
+                v = old_v.row(y);
+                density = old_density.row(y);
+            } else {
+                u = buffer;
+                v = buffer + nx;
+                density = buffer + 2*nx;
+                simd->load_row(old_u.row(y), u, nx);
+                simd->load_row(old_v.row(y), v, nx);
+                simd->load_row(old_density.row(y), density, nx);
+            }
+            if (noise != 0.0f) add_noise_row(u, v, row, noise_end);
+            for (int x = 0; x < nx; x++){
+                v[x] += (density[x]*buoyancy - gravity)*dt;
+                u[x] *= damping;
+                v[x] *= damping;
+            }
+            for (int i = 0; i < num_before; i++) add_splat_row(density, before[i], row);
+            for (int x = 0; x < nx; x++){
+                density[x] *= fade;
+            }
+            for (int i = 0; i < num_after; i++) add_splat_row(density, after[i], row);
+            if (sparse){
+                const ActiveTiles &tiles = density_tiles;
+                float *maxima = tile_row_maxima.data() + y*tiles.tiles_x;
+                for (int tx = 0; tx < tiles.tiles_x; tx++){
+                    int x1 = std::min((tx + 1)*tiles.tile, nx);
+                    float m = 0.0f;
+                    for (int x = tx*tiles.tile; x < x1; x++) m = std::max(m, fabsf(density[x]));
+                    maxima[tx] = m;
+                }
+            }
+            if constexpr (!std::is_same<T, float>::value){
+                simd->store_row(u, old_u.row(y), nx);
+                simd->store_row(v, old_v.row(y), nx);
+                simd->store_row(density, old_density.row(y), nx);
+            }
+        }
+    }
+
+    void add_density(int px, int py, int r = 10, float value = 0.5f){
+        for (int y = -r; y <= r; y++) for (int x = -r; x <= r; x++){
+            float d = sqrtf(x*x + y*y);
+            float u = smoothstep(float(r), 0.0f, d);
+            T &cell = old_density.at(px + x, py + y);
+            cell = cell + u*value;
+        }
+        old_density.fill_halo();
+    }
+
+    void step(){
+        PROFILE_SCOPE("step");
+        PERF_SCOPE("step");
+
+        // the mouse before the fade, the two sources at the bottom after it
+        Splat mouse_splat = {int(mouse.x), int(mouse.y), 10, 0.5f};
+        Splat sources[] = {
+            {int(nx*0.25f), 30, 10, 0.5f},
+            {int(nx*0.75f), 30, 10, 0.5f},
+        };
+        apply_forcing(&mouse_splat, 1, sources, 2);
+
+        double t[5];
+
+        t[0] = sec();
+        vorticity_confinement();
+        t[1] = sec();
+        //diffuse_velocity();
+        //project_velocity();
+        advect_velocity();
+        t[2] = sec();
+        project_velocity();
+        t[3] = sec();
+
+        //diffuse_density();
+        advect_density();
+        t[4] = sec();
+
+        // zero out stuff at bottom
+        {
+            PROFILE_SCOPE("clear_bottom");
+            PERF_SCOPE("clear_bottom");
+            // in a slab they may be any rows of the grids, or none
+            parallel_for(pool, 0, ny, [&](int y0, int y1){
+                for (int y = y0; y < y1; y++){
+                    if (domain_row(y) >= bottom_rows) continue;
+                    for (int x = 0; x < nx; x++){
+                        old_density(x, y) = 0.0f;
+                        old_u(x, y) = 0.0f;
+                        old_v(x, y) = 0.0f;
+                    }
+                }
+            });
+            old_density.fill_halo();
+            fill_velocity_halo();
+        }
+
+        for (int i = 0; i < 4; i++){
+            timings[i] = (t[i + 1] - t[i])*1000;
+        }
+
+        if (cfl > 0.0f) dt = cfl_dt();
+
+        frame++;
+    }
+};
+
+typedef BasicFluidSolver<float> FluidSolver;
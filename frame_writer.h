@@ -0,0 +1,199 @@
+#pragma once
+
+// Streams frames to a Y4M file or pipe from a background thread.
+//
+//     FrameWriter writer;
+//     writer.open("out.y4m", w, h);          // or "|ffmpeg -i - out.mp4"
+//     if (uint32_t *frame = writer.acquire()){
+//         glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, frame);
+//         writer.submit();
+//     }
+//     writer.close();
+//
+// Frames are RGBA pixels with the bottom row first, as OpenGL reads them.
+// A fixed set of buffers circulates between the caller and the writer
+// thread, which converts them to YUV 4:4:4 and writes them. When all
+// buffers are queued, acquire() either waits for the writer (the default)
+// or returns nullptr and counts the frame as dropped.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "timer.h"
+
+struct FrameWriter {
+    FILE *fp = nullptr;
+    bool is_pipe = false;
+    int width = 0;
+    int height = 0;
+    bool drop_when_full = false;
+
+    std::vector<std::vector<uint32_t>> buffers;
+    // indices of buffers owned by the caller's side, ready to be acquired
+    std::vector<int> free_buffers;
+    // ring of indices of buffers waiting to be written
+    std::vector<int> queue;
+    int queue_head = 0;
+    int queue_count = 0;
+    // buffer handed out by acquire(), -1 if none
+    int current = -1;
+    // converted frame, used only by the writer thread
+    std::vector<uint8_t> yuv;
+
+    std::mutex mutex;
+    std::condition_variable queued_condition;
+    std::condition_variable free_condition;
+    std::thread thread;
+    bool closing = false;
+    bool failed = false;
+
+    long frames_submitted = 0;
+    long frames_written = 0;
+    long frames_dropped = 0;
+    // time acquire() spent waiting for a free buffer
+    double stall_seconds = 0.0;
+
+    FrameWriter() = default;
+    FrameWriter(const FrameWriter&) = delete;
+    FrameWriter& operator = (const FrameWriter&) = delete;
+
+    ~FrameWriter(){
+        close();
+    }
+
+    // path starting with | is a command to pipe the stream into
+    bool open(const char *path, int width, int height, int fps = 50, int num_buffers = 4){
+        close();
+        is_pipe = path[0] == '|';
+#ifdef SIGPIPE
+        // a command which exits early makes the writes fail instead of killing us
+        if (is_pipe) signal(SIGPIPE, SIG_IGN);
+#endif
+        fp = is_pipe ? popen(path + 1, "w") : fopen(path, "wb");
+        if (!fp){
+            printf("Could not open %s\n", path);
+            return false;
+        }
+        fprintf(fp, "YUV4MPEG2 W%i H%i F%i:1 Ip A1:1 C444\n", width, height, fps);
+
+        this->width = width;
+        this->height = height;
+        buffers.assign(num_buffers, std::vector<uint32_t>(width*height));
+        free_buffers.clear();
+        free_buffers.reserve(num_buffers);
+        for (int i = num_buffers - 1; i >= 0; i--) free_buffers.push_back(i);
+        queue.assign(num_buffers, -1);
+        yuv.resize(3*width*height);
+        queue_head = 0;
+        queue_count = 0;
+        current = -1;
+        closing = false;
+        failed = false;
+        frames_submitted = frames_written = frames_dropped = 0;
+        stall_seconds = 0.0;
+
+        thread = std::thread(&FrameWriter::writer_loop, this);
+        return true;
+    }
+
+    bool is_open() const {
+        return fp != nullptr;
+    }
+
+    // width*height pixels to fill, or nullptr if the frame is dropped
+    uint32_t* acquire(){
+        std::unique_lock<std::mutex> lock(mutex);
+        if (free_buffers.empty()){
+            if (drop_when_full){
+                frames_dropped++;
+                return nullptr;
+            }
+            double t = sec();
+            free_condition.wait(lock, [this]{ return !free_buffers.empty(); });
+            stall_seconds += sec() - t;
+        }
+        current = free_buffers.back();
+        free_buffers.pop_back();
+        return buffers[current].data();
+    }
+
+    // queues the frame returned by the last acquire()
+    void submit(){
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue[(queue_head + queue_count) % queue.size()] = current;
+            queue_count++;
+            current = -1;
+            frames_submitted++;
+        }
+        queued_condition.notify_one();
+    }
+
+    // writes the queued frames and closes the stream
+    void close(){
+        if (!fp) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closing = true;
+        }
+        queued_condition.notify_one();
+        thread.join();
+        if (is_pipe) pclose(fp); else fclose(fp);
+        fp = nullptr;
+    }
+
+    void print_stats(FILE *out) const {
+        fprintf(out, "frames written   %li of %li, %li dropped, %f s waiting for the writer%s\n",
+            frames_written, frames_submitted, frames_dropped, stall_seconds,
+            failed ? ", write failed" : "");
+    }
+
+    void writer_loop(){
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;){
+            queued_condition.wait(lock, [this]{ return queue_count > 0 || closing; });
+            if (queue_count == 0) break;
+            int index = queue[queue_head];
+            queue_head = (queue_head + 1) % queue.size();
+            queue_count--;
+            lock.unlock();
+
+            rgba_to_yuv444(buffers[index].data(), yuv.data());
+            // after a failed write the frames are still taken, so acquire() never blocks forever
+            bool ok = !failed;
+            if (ok){
+                ok = fputs("FRAME\n", fp) >= 0 && fwrite(yuv.data(), 1, yuv.size(), fp) == yuv.size();
+            }
+
+            lock.lock();
+            if (ok) frames_written++;
+            else failed = true;
+            free_buffers.push_back(index);
+            free_condition.notify_one();
+        }
+    }
+
+    // BT.601 studio range, rows flipped to top first, planes Y, U, V
+    void rgba_to_yuv444(const uint32_t *rgba, uint8_t *yuv) const {
+        int n = width*height;
+        for (int y = 0; y < height; y++){
+            const uint32_t *row = rgba + (height - 1 - y)*width;
+            uint8_t *Y = yuv + y*width;
+            uint8_t *U = Y + n;
+            uint8_t *V = U + n;
+            for (int x = 0; x < width; x++){
+                int r = (row[x] >> 0*8) & 255;
+                int g = (row[x] >> 1*8) & 255;
+                int b = (row[x] >> 2*8) & 255;
+                Y[x] = ((66*r + 129*g + 25*b + 128) >> 8) + 16;
+                U[x] = ((-38*r - 74*g + 112*b + 128) >> 8) + 128;
+                V[x] = ((112*r - 94*g - 18*b + 128) >> 8) + 128;
+            }
+        }
+    }
+};
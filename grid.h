@@ -0,0 +1,190 @@
+#pragma once
+
+#include <assert.h>
+#include <math.h>
+#include <stddef.h>
+#include <algorithm>
+#include <new>
+#include "vec2.h"
+
+// alignment of grid rows and scratch memory, one cache line
+const size_t GRID_ALIGNMENT = 64;
+
+void* aligned_allocate(size_t bytes){
+    return operator new(bytes, std::align_val_t(GRID_ALIGNMENT));
+}
+
+void aligned_free(void *p){
+    operator delete(p, std::align_val_t(GRID_ALIGNMENT));
+}
+
+// Boundary policies decide what lies outside of a grid. map() takes any
+// coordinate to one which can be read, the halo cells around the grid
+// hold the values of the cells they map to.
+
+// wrap around
+struct Periodic {
+    static int map(int x, int n){
+        return ((x % n) + n) % n;
+    }
+};
+
+// repeat the border cells
+struct Clamp {
+    static int map(int x, int n){
+        return clamp(x, 0, n - 1);
+    }
+};
+
+// zero outside, the halo cells are zero and everything further out maps to them
+struct Zero {
+    static int map(int x, int n){
+        return clamp(x, -1, n);
+    }
+};
+
+// Grid with one halo cell on each side. Cells (x, y) with x in [-1, nx] and
+// y in [-1, ny] can be indexed directly, so stencils need no wrap around
+// as long as fill_halo() is called after the interior has been written.
+// Rows are padded so that every row starts on GRID_ALIGNMENT.
+template <typename T, typename Boundary = Periodic>
+struct Grid {
+    // cell (0, 0)
+    T *values;
+    // start of the allocation, including the halo
+    T *memory;
+    int nx, ny;
+    // elements from one row to the next
+    int stride;
+    // false if memory belongs to someone else, e.g. a Workspace
+    bool owner;
+
+    static int left_padding(){
+        return std::max<int>(1, GRID_ALIGNMENT/sizeof(T));
+    }
+
+    static int row_stride(int nx){
+        int pad = left_padding();
+        return (pad + nx + 1 + pad - 1)/pad*pad;
+    }
+
+    // bytes of memory for a grid of the given size
+    static size_t storage_size(int nx, int ny){
+        return sizeof(T)*row_stride(nx)*(ny + 2);
+    }
+
+    Grid(int nx, int ny): nx(nx), ny(ny), stride(row_stride(nx)), owner(true){
+        memory = (T*)aligned_allocate(storage_size(nx, ny));
+        values = memory + stride + left_padding();
+    }
+
+    Grid(int nx, int ny, T *memory): memory(memory), nx(nx), ny(ny), stride(row_stride(nx)), owner(false){
+        values = memory + stride + left_padding();
+    }
+
+    Grid(const Grid&) = delete;
+    Grid& operator = (const Grid&) = delete;
+
+    ~Grid(){
+        if (owner) aligned_free(memory);
+    }
+
+    // the memory goes along with whoever has to free it
+    void swap(Grid &other){
+        std::swap(values, other.values);
+        std::swap(memory, other.memory);
+        std::swap(nx, other.nx);
+        std::swap(ny, other.ny);
+        std::swap(stride, other.stride);
+        std::swap(owner, other.owner);
+    }
+
+    // x in [-1, nx] and y in [-1, ny]
+    int idx(int x, int y) const {
+        return x + y*stride;
+    }
+
+    T* row(int y){
+        return values + y*stride;
+    }
+
+    const T* row(int y) const {
+        return values + y*stride;
+    }
+
+    T& operator () (int x, int y){
+        return values[idx(x, y)];
+    }
+
+    const T& operator () (int x, int y) const {
+        return values[idx(x, y)];
+    }
+
+    // any coordinate, mapped by the boundary policy
+    T& at(int x, int y){
+        return (*this)(Boundary::map(x, nx), Boundary::map(y, ny));
+    }
+
+    const T& at(int x, int y) const {
+        return (*this)(Boundary::map(x, nx), Boundary::map(y, ny));
+    }
+
+    // sets every cell including the halo
+    void fill(T value){
+        for (size_t i = 0; i < storage_size(nx, ny)/sizeof(T); i++) memory[i] = value;
+    }
+
+    void fill_halo(){
+        for (int y = 0; y < ny; y++){
+            T *r = row(y);
+            r[-1] = halo_value(-1, y);
+            r[nx] = halo_value(nx, y);
+        }
+        T *bottom = row(-1);
+        T *top = row(ny);
+        for (int x = -1; x <= nx; x++){
+            bottom[x] = halo_value(x, -1);
+            top[x] = halo_value(x, ny);
+        }
+    }
+
+    T halo_value(int x, int y) const {
+        int mx = Boundary::map(x, nx);
+        int my = Boundary::map(y, ny);
+        // Zero maps the halo onto itself
+        if (mx == x && my == y) return T{};
+        return (*this)(mx, my);
+    }
+};
+
+// type which values stored as T are computed in, e.g. float for float16
+template <typename T>
+struct Arithmetic {
+    typedef T type;
+};
+
+template <typename T, typename Boundary>
+typename Arithmetic<T>::type interpolate(const Grid<T, Boundary> &grid, vec2f p){
+    typedef typename Arithmetic<T>::type A;
+    int ix = floorf(p.x);
+    int iy = floorf(p.y);
+    float ux = p.x - ix;
+    float uy = p.y - iy;
+
+    // all four taps within the halo
+    if (ix >= -1 && ix < grid.nx && iy >= -1 && iy < grid.ny){
+        return lerp(
+            lerp(A(grid(ix + 0, iy + 0)), A(grid(ix + 1, iy + 0)), ux),
+            lerp(A(grid(ix + 0, iy + 1)), A(grid(ix + 1, iy + 1)), ux),
+            uy
+        );
+    }
+
+    return lerp(
+        lerp(A(grid.at(ix + 0, iy + 0)), A(grid.at(ix + 1, iy + 0)), ux),
+        lerp(A(grid.at(ix + 0, iy + 1)), A(grid.at(ix + 1, iy + 1)), ux),
+        uy
+    );
+}
+
+#define FOR_EACH_CELL for (int y = 0; y < ny; y++) for (int x = 0; x < nx; x++)
@@ -0,0 +1,92 @@
+#pragma once
+
+// 16 bit storage types for the grids. Values are converted to float for
+// any arithmetic and rounded to nearest even when stored, the same way
+// the F16C instructions do, so the vectorized kernels in simd.h give the
+// same results as the scalar conversions here.
+//
+// float16 is IEEE binary16: 11 significant bits, at most 65504.
+// bfloat16 is the top half of a float: 8 significant bits, float range.
+
+#include <stdint.h>
+#include <string.h>
+#include "grid.h"
+
+inline uint32_t float_bits(float f){
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    return x;
+}
+
+inline float bits_float(uint32_t x){
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+// Both conversions handle zeros, denormals, infinities and NaN. The
+// denormal cases rely on float arithmetic with denormals, which is the
+// default unless the program sets flush to zero.
+inline uint16_t float_to_half_bits(float f){
+    uint32_t x = float_bits(f);
+    uint32_t sign = (x >> 16) & 0x8000;
+    x &= 0x7fffffff;
+    uint32_t h;
+    if (x >= 0x47800000){
+        // too large or infinity, NaN keeps the top of its payload and turns quiet
+        h = x > 0x7f800000 ? 0x7e00 | ((x >> 13) & 0x3ff) : 0x7c00;
+    } else if (x < 0x38800000){
+        // denormal or zero, adding 0.5 rounds the mantissa into place
+        h = float_bits(bits_float(x) + 0.5f) - 0x3f000000;
+    } else {
+        // rebias the exponent and round, a carry may reach infinity
+        h = (x - (112u << 23) + 0xfff + ((x >> 13) & 1)) >> 13;
+    }
+    return h | sign;
+}
+
+inline float half_bits_to_float(uint16_t h){
+    uint32_t x = (h & 0x7fff) << 13;
+    // scaling by 2^112 rebiases the exponent and normalizes denormals
+    uint32_t bits = float_bits(bits_float(x)*bits_float(0x77800000));
+    // infinity or NaN, which turns quiet
+    if (x >= 0x0f800000) bits |= x > 0x0f800000 ? 0x7fc00000 : 0x7f800000;
+    return bits_float(bits | uint32_t(h & 0x8000) << 16);
+}
+
+inline uint16_t float_to_bfloat16_bits(float f){
+    uint32_t x = float_bits(f);
+    // NaN would round to infinity
+    if ((x & 0x7fffffff) > 0x7f800000) return (x >> 16) | 0x40;
+    return (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+}
+
+inline float bfloat16_bits_to_float(uint16_t h){
+    return bits_float(uint32_t(h) << 16);
+}
+
+struct float16 {
+    uint16_t bits;
+
+    float16() = default;
+    float16(float f): bits(float_to_half_bits(f)){}
+    operator float() const { return half_bits_to_float(bits); }
+};
+
+struct bfloat16 {
+    uint16_t bits;
+
+    bfloat16() = default;
+    bfloat16(float f): bits(float_to_bfloat16_bits(f)){}
+    operator float() const { return bfloat16_bits_to_float(bits); }
+};
+
+template <>
+struct Arithmetic<float16> {
+    typedef float type;
+};
+
+template <>
+struct Arithmetic<bfloat16> {
+    typedef float type;
+};
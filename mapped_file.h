@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MAPPED_FILE_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// A file mapped copy on write, it stays mapped until unmap() or destruction.
+struct MappedFile {
+    char *data = nullptr;
+    uint64_t bytes = 0;
+
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator = (const MappedFile&) = delete;
+
+    ~MappedFile(){
+        unmap();
+    }
+
+    bool map(const char *path){
+        unmap();
+#ifdef MAPPED_FILE_MMAP
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0){
+            void *p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED){
+                data = (char*)p;
+                bytes = st.st_size;
+            }
+        }
+        close(fd);
+#else
+        (void)path;
+#endif
+        return data != nullptr;
+    }
+
+    void unmap(){
+#ifdef MAPPED_FILE_MMAP
+        if (data) munmap(data, bytes);
+#endif
+        data = nullptr;
+        bytes = 0;
+    }
+};
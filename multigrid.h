@@ -0,0 +1,201 @@
+#pragma once
+
+#include <math.h>
+#include <vector>
+#include "grid.h"
+#include "thread_pool.h"
+#include "fft.h"
+
+// Geometric multigrid for the periodic pressure equation
+//
+//     p(x+1, y) + p(x-1, y) + p(x, y+1) + p(x, y-1) - 4 p(x, y) = f(x, y)
+//
+// which is the fixed point of the Jacobi iteration in project_velocity().
+// Grids are halved while both sides are even and larger than min_size, so
+// sizes with many factors of two give the deepest hierarchy. Coarse grids
+// are periodic as well. The coarsest level is solved exactly with the FFT,
+// which leaves sizes without a factor of two with a single level and thus
+// a direct solve.
+struct Multigrid {
+    struct Level {
+        int nx, ny;
+        // squared grid spacing relative to the finest level
+        float h2;
+        Grid<float> p, f, r;
+
+        Level(int nx, int ny, float h2): nx(nx), ny(ny), h2(h2), p(nx, ny), f(nx, ny), r(nx, ny){}
+    };
+
+    std::vector<Level*> levels;
+
+    // of the coarsest level
+    FftPoisson *coarsest = nullptr;
+
+    int pre_smooth = 2;
+    int post_smooth = 2;
+    int min_size = 4;
+    // 1 for V-cycles, 2 for W-cycles
+    int gamma = 1;
+    // relaxation factor of the smoother
+    float omega = 1.0f;
+
+    ThreadPool *pool = nullptr;
+
+    Multigrid(int nx, int ny){
+        float h2 = 1.0f;
+        levels.push_back(new Level(nx, ny, h2));
+        while (nx % 2 == 0 && ny % 2 == 0 && nx/2 >= min_size && ny/2 >= min_size){
+            nx /= 2;
+            ny /= 2;
+            h2 *= 4.0f;
+            levels.push_back(new Level(nx, ny, h2));
+        }
+        coarsest = new FftPoisson(nx, ny);
+    }
+
+    Multigrid(const Multigrid&) = delete;
+    Multigrid& operator = (const Multigrid&) = delete;
+
+    ~Multigrid(){
+        for (Level *level : levels) delete level;
+        delete coarsest;
+    }
+
+    template <typename F>
+    void for_each_cell(const Level &level, F f){
+        int nx = level.nx;
+        parallel_for(pool, 0, level.ny, [&](int y0, int y1){
+            for (int y = y0; y < y1; y++) for (int x = 0; x < nx; x++) f(x, y);
+        });
+    }
+
+    // red-black Gauss-Seidel sweeps in place, see FluidSolver::red_black_sor()
+    void smooth(Level &level, Grid<float> &p, const Grid<float> &f, int sweeps){
+        int nx = level.nx;
+        int ny = level.ny;
+        float h2 = level.h2;
+        float omega = this->omega;
+        // with odd sizes, cells of the same color touch across the wrap around
+        ThreadPool *pool = nx % 2 == 0 && ny % 2 == 0 ? this->pool : nullptr;
+
+        for (int k = 0; k < sweeps; k++){
+            for (int color = 0; color < 2; color++){
+                parallel_for(pool, 0, ny, [&](int y0, int y1){
+                    for (int y = y0; y < y1; y++){
+                        for (int x = (y + color) & 1; x < nx; x += 2){
+                            float sum = -h2*f(x, y)
+                                + p(x + 1, y + 0)
+                                + p(x - 1, y + 0)
+                                + p(x + 0, y + 1)
+                                + p(x + 0, y - 1);
+                            p(x, y) += omega*(0.25f*sum - p(x, y));
+                        }
+                    }
+                });
+                p.fill_halo();
+            }
+        }
+    }
+
+    void compute_residual(Level &level, const Grid<float> &p, const Grid<float> &f, Grid<float> &r){
+        float inv_h2 = 1.0f/level.h2;
+        for_each_cell(level, [&](int x, int y){
+            float laplacian =
+                + p(x + 1, y + 0)
+                + p(x - 1, y + 0)
+                + p(x + 0, y + 1)
+                + p(x + 0, y - 1)
+                - 4.0f*p(x, y);
+            r(x, y) = f(x, y) - inv_h2*laplacian;
+        });
+        r.fill_halo();
+    }
+
+    // full weighting of the fine residual onto the coarse right hand side
+    void restrict_residual(const Grid<float> &r, Level &coarse){
+        Grid<float> &f = coarse.f;
+        for_each_cell(coarse, [&](int x, int y){
+            int fx = 2*x;
+            int fy = 2*y;
+            f(x, y) = (1.0f/16.0f)*(
+                4.0f*r(fx, fy)
+                + 2.0f*(r(fx - 1, fy) + r(fx + 1, fy) + r(fx, fy - 1) + r(fx, fy + 1))
+                + r(fx - 1, fy - 1) + r(fx + 1, fy - 1) + r(fx - 1, fy + 1) + r(fx + 1, fy + 1)
+            );
+        });
+        f.fill_halo();
+    }
+
+    // bilinear interpolation of the coarse correction onto the fine solution
+    void prolongate_correction(const Level &coarse, const Level &fine, Grid<float> &p){
+        const Grid<float> &e = coarse.p;
+        for_each_cell(fine, [&](int x, int y){
+            int cx = x >> 1;
+            int cy = y >> 1;
+            float wx = (x & 1)*0.5f;
+            float wy = (y & 1)*0.5f;
+            p(x, y) += lerp(
+                lerp(e(cx, cy + 0), e(cx + 1, cy + 0), wx),
+                lerp(e(cx, cy + 1), e(cx + 1, cy + 1), wx),
+                wy
+            );
+        });
+        p.fill_halo();
+    }
+
+    // The FFT solves the equation without h2 and drops the constant part of
+    // f, which has no solution on a periodic domain. p and f are the
+    // caller's when there is only one level.
+    void solve_coarsest(Level &level, Grid<float> &p, const Grid<float> &f){
+        float h2 = level.h2;
+        for_each_cell(level, [&](int x, int y){
+            level.r(x, y) = h2*f(x, y);
+        });
+        coarsest->pool = pool;
+        coarsest->solve(p, level.r);
+    }
+
+    void cycle(int l, Grid<float> &p, const Grid<float> &f){
+        Level &level = *levels[l];
+
+        if (l + 1 == (int)levels.size()){
+            solve_coarsest(level, p, f);
+            return;
+        }
+
+        Level &coarse = *levels[l + 1];
+
+        smooth(level, p, f, pre_smooth);
+
+        compute_residual(level, p, f, level.r);
+        restrict_residual(level.r, coarse);
+
+        coarse.p.fill(0.0f);
+
+        for (int k = 0; k < gamma; k++){
+            cycle(l + 1, coarse.p, coarse.f);
+        }
+
+        prolongate_correction(coarse, level, p);
+
+        smooth(level, p, f, post_smooth);
+    }
+
+    // improves the initial guess in p with the given number of cycles
+    void solve(Grid<float> &p, const Grid<float> &f, int cycles){
+        for (int k = 0; k < cycles; k++){
+            cycle(0, p, f);
+        }
+    }
+
+    // root mean square of f - L p on the finest level
+    float residual(const Grid<float> &p, const Grid<float> &f){
+        Level &level = *levels[0];
+        int nx = level.nx;
+        int ny = level.ny;
+        compute_residual(level, p, f, level.r);
+        double sum = 0.0;
+        FOR_EACH_CELL sum += double(level.r(x, y))*level.r(x, y);
+        return sqrt(sum/(nx*ny));
+    }
+};
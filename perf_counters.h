@@ -0,0 +1,294 @@
+#pragma once
+
+// Hardware performance counters per solver phase, read with Linux
+// perf_event_open. Every thread which runs solver work opens its own group
+// of counters (user space only, which perf_event_paranoid <= 2 allows), and
+//
+//     PERF_SCOPE("advect_velocity");
+//
+// adds the change of all threads' counters until the end of the scope to
+// that phase. Scopes are meant for the thread which drives the solver, the
+// workers are idle between phases so their counters can be read from there.
+// Nothing is measured until perf_monitor.enable() succeeds; elsewhere than
+// Linux it always fails. Scopes do not allocate.
+//
+// The kernel schedules a group as a whole, so when it has to multiplex the
+// PMU the counters of a group still run at the same time and their ratios
+// hold. Counts are scaled by the time the group was enabled over the time
+// it ran.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+enum PerfEvent {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_LLC_MISSES,
+    PERF_STALLED_CYCLES,
+    PERF_NUM_EVENTS,
+};
+
+const char *perf_event_names[PERF_NUM_EVENTS] = {
+    "cycles", "instructions", "LLC misses", "stalled cycles",
+};
+
+struct PerfValues {
+    uint64_t v[PERF_NUM_EVENTS] = {};
+};
+
+// raw counts of a group and the nanoseconds it was enabled and running
+struct PerfReading {
+    PerfValues values;
+    uint64_t enabled = 0;
+    uint64_t running = 0;
+};
+
+// one counter group of the calling thread, led by the cycle counter
+struct PerfThread {
+    int fds[PERF_NUM_EVENTS];
+
+    PerfThread(){
+        for (int i = 0; i < PERF_NUM_EVENTS; i++) fds[i] = -1;
+    }
+
+    // false if not even the cycle counter can be opened, the other
+    // counters join its group where they can
+    bool open(){
+#ifdef __linux__
+        uint64_t configs[PERF_NUM_EVENTS] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_STALLED_CYCLES_BACKEND,
+        };
+        for (int i = 0; i < PERF_NUM_EVENTS; i++){
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[i];
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            int leader = fds[PERF_CYCLES];
+            if (i > 0 && leader < 0) break;
+            // counts only this thread, on whichever CPU it runs
+            fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, i > 0 ? leader : -1, 0);
+        }
+        return fds[PERF_CYCLES] >= 0;
+#else
+        return false;
+#endif
+    }
+
+    ~PerfThread(){
+#ifdef __linux__
+        for (int i = 0; i < PERF_NUM_EVENTS; i++){
+            if (fds[i] >= 0) close(fds[i]);
+        }
+#endif
+    }
+
+    // The whole group at once, counters which could not be opened read as
+    // zero. The group lists its counters in the order they were opened.
+    PerfReading read_group() const {
+        PerfReading reading;
+#ifdef __linux__
+        if (fds[PERF_CYCLES] < 0) return reading;
+        // nr, time enabled, time running, then one value per counter
+        uint64_t data[3 + PERF_NUM_EVENTS];
+        ssize_t bytes = read(fds[PERF_CYCLES], data, sizeof(data));
+        if (bytes < ssize_t(3*sizeof(uint64_t))) return reading;
+        uint64_t n = std::min<uint64_t>(data[0], (bytes - 3*sizeof(uint64_t))/sizeof(uint64_t));
+        reading.enabled = data[1];
+        reading.running = data[2];
+        uint64_t k = 0;
+        for (int i = 0; i < PERF_NUM_EVENTS && k < n; i++){
+            if (fds[i] >= 0) reading.values.v[i] = data[3 + k++];
+        }
+#endif
+        return reading;
+    }
+};
+
+struct PerfPhase {
+    const char *name = nullptr;
+    long calls = 0;
+    PerfValues total;
+};
+
+struct PerfMonitor {
+    // scopes nested deeper are not measured
+    static const int max_depth = 8;
+    // distinct scope names, later ones are not measured
+    static const int max_phases = 64;
+
+    bool enabled = false;
+    // which counters opened on the first thread
+    bool available[PERF_NUM_EVENTS] = {};
+
+    std::mutex mutex;
+    // never freed, threads may stop before the report
+    std::vector<PerfThread*> threads;
+    // in the order they were first seen, reserved by enable()
+    std::vector<PerfPhase> phases;
+
+    // readings of every thread at the start of each open scope,
+    // [thread*max_depth + depth], and at the end of the innermost one,
+    // grown when a thread attaches
+    std::vector<PerfReading> begin;
+    std::vector<PerfReading> end;
+    // of the scopes open on the thread which drives the solver
+    int depth = 0;
+
+    // opens the counters of the calling thread, false if that fails
+    bool enable(){
+        PerfThread *thread = new PerfThread();
+        if (!thread->open()){
+#ifdef __linux__
+            printf("perf_event_open failed: %s\n", strerror(errno));
+#endif
+            delete thread;
+            return false;
+        }
+        for (int i = 0; i < PERF_NUM_EVENTS; i++) available[i] = thread->fds[i] >= 0;
+        phases.reserve(max_phases);
+        add(thread);
+        enabled = true;
+        return true;
+    }
+
+    void add(PerfThread *thread);
+
+    // called by every thread which might run solver work
+    void attach_thread();
+
+    PerfPhase* find_phase(const char *name){
+        for (PerfPhase &phase : phases){
+            if (phase.name == name || strcmp(phase.name, name) == 0) return &phase;
+        }
+        if ((int)phases.size() == max_phases) return nullptr;
+        PerfPhase phase;
+        phase.name = name;
+        phases.push_back(phase);
+        return &phases.back();
+    }
+
+    // Reads every attached thread into begin at depth, or into end if depth
+    // is negative, and returns the number of threads read.
+    size_t read_all(int depth){
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t t = 0; t < threads.size(); t++){
+            PerfReading reading = threads[t]->read_group();
+            if (depth < 0) end[t] = reading;
+            else begin[t*max_depth + depth] = reading;
+        }
+        return threads.size();
+    }
+
+    // Adds the counts between the readings at depth and the end readings,
+    // scaled by how long each group was enabled over how long it ran.
+    void add_to_phase(const char *name, int depth, size_t begin_threads, size_t end_threads){
+        PerfPhase *phase = find_phase(name);
+        if (!phase) return;
+        phase->calls++;
+        for (size_t t = 0; t < end_threads; t++){
+            // threads which attached during the phase started at zero
+            PerfReading before = t < begin_threads ? begin[t*max_depth + depth] : PerfReading();
+            const PerfReading &after = end[t];
+            uint64_t running = after.running - before.running;
+            if (running == 0) continue;
+            double scale = double(after.enabled - before.enabled)/running;
+            for (int i = 0; i < PERF_NUM_EVENTS; i++){
+                phase->total.v[i] += uint64_t((after.values.v[i] - before.values.v[i])*scale + 0.5);
+            }
+        }
+    }
+
+    // per call averages of every phase by name, cells is the size of the grid
+    void report(FILE *fp, double cells){
+        std::vector<PerfPhase> sorted = phases;
+        std::sort(sorted.begin(), sorted.end(), [](const PerfPhase &a, const PerfPhase &b){
+            return strcmp(a.name, b.name) < 0;
+        });
+        fprintf(fp, "%-22s %6s %14s %14s %6s %12s %10s", "phase", "calls", "cycles", "instructions", "IPC", "LLC misses", "bytes/cell");
+        if (available[PERF_STALLED_CYCLES]) fprintf(fp, " %8s", "stalled");
+        fprintf(fp, "\n");
+        for (const PerfPhase &phase : sorted){
+            const uint64_t *v = phase.total.v;
+            double calls = phase.calls;
+            double ipc = v[PERF_CYCLES] ? double(v[PERF_INSTRUCTIONS])/v[PERF_CYCLES] : 0.0;
+            // every last level miss brings in one cache line
+            double bytes_per_cell = v[PERF_LLC_MISSES]*64.0/(cells*calls);
+            fprintf(fp, "%-22s %6li %14.0f %14.0f %6.2f %12.0f %10.2f",
+                phase.name, phase.calls,
+                v[PERF_CYCLES]/calls, v[PERF_INSTRUCTIONS]/calls, ipc,
+                v[PERF_LLC_MISSES]/calls, bytes_per_cell);
+            if (available[PERF_STALLED_CYCLES]){
+                fprintf(fp, " %7.1f%%", v[PERF_CYCLES] ? 100.0*v[PERF_STALLED_CYCLES]/v[PERF_CYCLES] : 0.0);
+            }
+            fprintf(fp, "\n");
+        }
+        for (int i = 0; i < PERF_NUM_EVENTS; i++){
+            if (!available[i]) fprintf(fp, "%s not available\n", perf_event_names[i]);
+        }
+    }
+};
+
+PerfMonitor perf_monitor;
+thread_local PerfThread *perf_thread = nullptr;
+
+void PerfMonitor::add(PerfThread *thread){
+    std::lock_guard<std::mutex> lock(mutex);
+    threads.push_back(thread);
+    begin.resize(threads.size()*max_depth);
+    end.resize(threads.size());
+    perf_thread = thread;
+}
+
+void PerfMonitor::attach_thread(){
+    if (!enabled || perf_thread) return;
+    PerfThread *thread = new PerfThread();
+    thread->open();
+    add(thread);
+}
+
+struct PerfScope {
+    const char *name;
+    // -1 if not measured
+    int depth = -1;
+    size_t begin_threads = 0;
+
+    PerfScope(const char *name): name(name){
+        if (!perf_monitor.enabled) return;
+        if (perf_monitor.depth < PerfMonitor::max_depth){
+            depth = perf_monitor.depth;
+            begin_threads = perf_monitor.read_all(depth);
+        }
+        perf_monitor.depth++;
+    }
+
+    ~PerfScope(){
+        if (!perf_monitor.enabled) return;
+        perf_monitor.depth--;
+        if (depth < 0) return;
+        size_t end_threads = perf_monitor.read_all(-1);
+        perf_monitor.add_to_phase(name, depth, begin_threads, end_threads);
+    }
+};
+
+#define PERF_CONCAT2(a, b) a##b
+#define PERF_CONCAT(a, b) PERF_CONCAT2(a, b)
+#define PERF_SCOPE(name) PerfScope PERF_CONCAT(perf_scope_, __LINE__)(name)
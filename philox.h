@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+
+// Philox4x32-10 counter based random numbers (Salmon et al., "Parallel
+// random numbers: as easy as 1, 2, 3"). Each counter gives four random
+// words which depend only on the counter and the key, so cells can draw
+// their numbers in any order, on any thread, and still get the same ones.
+struct Philox {
+    uint32_t v[4];
+};
+
+inline uint32_t philox_mulhilo(uint32_t a, uint32_t b, uint32_t &lo){
+    uint64_t product = uint64_t(a)*b;
+    lo = uint32_t(product);
+    return uint32_t(product >> 32);
+}
+
+inline Philox philox4x32(Philox counter, uint32_t key0, uint32_t key1){
+    uint32_t c0 = counter.v[0];
+    uint32_t c1 = counter.v[1];
+    uint32_t c2 = counter.v[2];
+    uint32_t c3 = counter.v[3];
+    // unrolled, so loops over counters have a straight body to vectorize
+    #pragma GCC unroll 10
+    for (int round = 0; round < 10; round++){
+        uint32_t lo0, lo1;
+        uint32_t hi0 = philox_mulhilo(0xD2511F53u, c0, lo0);
+        uint32_t hi1 = philox_mulhilo(0xCD9E8D57u, c2, lo1);
+        c0 = hi1 ^ c1 ^ key0;
+        c1 = lo1;
+        c2 = hi0 ^ c3 ^ key1;
+        c3 = lo0;
+        key0 += 0x9E3779B9u;
+        key1 += 0xBB67AE85u;
+    }
+    return Philox{{c0, c1, c2, c3}};
+}
+
+// uniform in [0, 1) from the top 24 bits
+inline float philox_uniform(uint32_t bits){
+    return (bits >> 8)*(1.0f/16777216.0f);
+}
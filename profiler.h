@@ -0,0 +1,185 @@
+#pragma once
+
+// Scoped timers for the solver phases and render stages.
+//
+//     PROFILE_SCOPE("advect_velocity");
+//
+// records the time until the end of the enclosing scope. Every thread
+// writes to its own ring buffer, so recording takes no locks, and the most
+// recent events of each thread are kept. profiler_report() writes them as
+// a Chrome trace (chrome://tracing or ui.perfetto.dev) and prints
+// histograms of the durations per name.
+//
+// Build with -DFLUID_PROFILE to enable, otherwise PROFILE_SCOPE expands to
+// nothing and the report functions do nothing.
+
+#ifdef FLUID_PROFILE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct ProfileEvent {
+    // string literal
+    const char *name;
+    // nanoseconds since the profiler started
+    int64_t begin, end;
+};
+
+struct ProfileBuffer {
+    static const int capacity = 1 << 16;
+    ProfileEvent events[capacity];
+    // events ever written, the last capacity of them are kept
+    std::atomic<uint64_t> count{0};
+    int thread_index;
+};
+
+struct Profiler {
+    std::mutex mutex;
+    // never freed, the events outlive the threads which wrote them
+    std::vector<ProfileBuffer*> buffers;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    ProfileBuffer* add_thread(){
+        std::lock_guard<std::mutex> lock(mutex);
+        ProfileBuffer *buffer = new ProfileBuffer();
+        buffer->thread_index = buffers.size();
+        buffers.push_back(buffer);
+        return buffer;
+    }
+
+    // copy of the events kept by each thread
+    std::vector<std::vector<ProfileEvent>> events(){
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<std::vector<ProfileEvent>> result;
+        for (ProfileBuffer *buffer : buffers){
+            uint64_t count = buffer->count.load(std::memory_order_acquire);
+            uint64_t first = count > ProfileBuffer::capacity ? count - ProfileBuffer::capacity : 0;
+            std::vector<ProfileEvent> events;
+            for (uint64_t i = first; i < count; i++){
+                events.push_back(buffer->events[i % ProfileBuffer::capacity]);
+            }
+            result.push_back(events);
+        }
+        return result;
+    }
+};
+
+Profiler profiler;
+thread_local ProfileBuffer *profile_buffer = nullptr;
+
+inline int64_t profile_now(){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - profiler.start).count();
+}
+
+struct ProfileScope {
+    const char *name;
+    int64_t begin;
+
+    ProfileScope(const char *name): name(name), begin(profile_now()){}
+
+    ~ProfileScope(){
+        int64_t end = profile_now();
+        if (!profile_buffer) profile_buffer = profiler.add_thread();
+        ProfileBuffer *buffer = profile_buffer;
+        // only this thread writes, readers see the event once count moves past it
+        uint64_t i = buffer->count.load(std::memory_order_relaxed);
+        buffer->events[i % ProfileBuffer::capacity] = ProfileEvent{name, begin, end};
+        buffer->count.store(i + 1, std::memory_order_release);
+    }
+};
+
+#define PROFILE_CONCAT2(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(name)
+
+bool profiler_write_trace(const char *path){
+    FILE *fp = fopen(path, "w");
+    if (!fp) return false;
+
+    std::vector<std::vector<ProfileEvent>> threads = profiler.events();
+    fprintf(fp, "{\"traceEvents\": [\n");
+    const char *separator = "";
+    for (size_t t = 0; t < threads.size(); t++){
+        fprintf(fp, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %i, \"args\": {\"name\": \"thread %i\"}}",
+            separator, (int)t, (int)t);
+        separator = ",\n";
+        for (const ProfileEvent &e : threads[t]){
+            fprintf(fp, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %i, \"ts\": %.3f, \"dur\": %.3f}",
+                separator, e.name, (int)t, e.begin*1e-3, (e.end - e.begin)*1e-3);
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    return true;
+}
+
+// count, mean and percentiles per name and a histogram in powers of two
+void profiler_print_histograms(FILE *fp){
+    std::map<std::string, std::vector<double>> durations;
+    for (const std::vector<ProfileEvent> &events : profiler.events()){
+        for (const ProfileEvent &e : events){
+            durations[e.name].push_back((e.end - e.begin)*1e-3);
+        }
+    }
+
+    for (auto &entry : durations){
+        std::vector<double> &d = entry.second;
+        std::sort(d.begin(), d.end());
+        double sum = 0.0;
+        for (double x : d) sum += x;
+        size_t n = d.size();
+        fprintf(fp, "%s: %zu events, mean %.1f us, p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n",
+            entry.first.c_str(), n, sum/n, d[n/2], d[n*9/10], d[n*99/100], d[n - 1]);
+
+        // bucket k counts durations in [2^k, 2^(k+1)) us, the first one all below 2 us
+        int buckets[32] = {};
+        int last = 0;
+        for (double x : d){
+            int k = 0;
+            while (k < 31 && x >= double(2u << k)) k++;
+            buckets[k]++;
+            last = std::max(last, k);
+        }
+        for (int k = 0; k <= last; k++){
+            if (!buckets[k]) continue;
+            int width = (int)(50.0*buckets[k]/n + 0.5);
+            fprintf(fp, "    < %8u us %8i %.*s\n", 2u << k, buckets[k], width,
+                "##################################################");
+        }
+    }
+}
+
+// trace to path and histograms to stdout
+void profiler_report(const char *path){
+    if (path && !profiler_write_trace(path)){
+        printf("Could not write %s\n", path);
+    }
+    profiler_print_histograms(stdout);
+}
+
+const char *profile_exit_path = nullptr;
+
+// report when the program exits, for front ends which never return from main
+void profiler_report_on_exit(const char *path){
+    profile_exit_path = path;
+    atexit([]{ profiler_report(profile_exit_path); });
+}
+
+#else
+
+#define PROFILE_SCOPE(name)
+
+inline void profiler_report(const char *){}
+inline void profiler_report_on_exit(const char *){}
+
+#endif
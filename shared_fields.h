@@ -0,0 +1,307 @@
+#pragma once
+
+// Live density and velocity for other processes, in a POSIX shared memory
+// segment holding a ring of the last few frames. The writer never waits:
+// each slot has a sequence number which is odd while the slot is being
+// written, a seqlock, and readers check that it did not change while they
+// looked at the slot. Readers map the segment read only and use the fields
+// in place, or copy them out.
+//
+//     SharedFieldsWriter writer;                // in the simulation
+//     writer.open("/fluid", nx, ny, 4);
+//     writer.publish(solver.frame, solver.old_density, solver.old_u, solver.old_v);
+//
+//     SharedFieldsReader reader;                // anywhere else
+//     reader.open("/fluid");
+//     SharedFieldsView view;
+//     if (reader.latest(view)){
+//         use(view.density);                    // nx*ny floats, row by row
+//         if (!reader.still_valid(view)) ...    // overwritten meanwhile, discard
+//     }
+//
+// Segment: SharedFieldsHeader, then slots of SharedFieldsSlot followed by
+// density, u and v, each nx*ny floats without padding, all of it aligned
+// to 64 bytes. Readers need nothing of the solver but this file, grid.h and timer.h.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include "grid.h"
+#include "timer.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SHARED_FIELDS_SHM
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+const char SHARED_FIELDS_MAGIC[8] = {'F', 'L', 'U', 'I', 'D', 'S', 'H', 'M'};
+const uint32_t SHARED_FIELDS_VERSION = 1;
+const int SHARED_FIELDS_CHANNELS = 3;
+
+struct alignas(64) SharedFieldsHeader {
+    // written last, once the rest is in place
+    char magic[8];
+    uint32_t version;
+    int32_t nx, ny;
+    int32_t slots;
+    // from the start of one slot to the next
+    uint64_t slot_bytes;
+    // frames published so far, the latest one is in slot (published - 1) % slots
+    std::atomic<uint64_t> published;
+};
+
+struct alignas(64) SharedFieldsSlot {
+    // odd while the slot is being written
+    std::atomic<uint64_t> sequence;
+    // step of the solver
+    uint64_t frame;
+    // CLOCK_MONOTONIC when the slot was complete, for latency measurements
+    int64_t publish_ns;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the seqlock needs lock free 64 bit atomics");
+
+// sec() reads CLOCK_MONOTONIC, which all processes share
+inline int64_t monotonic_ns(){
+    return int64_t(sec()*1e9);
+}
+
+inline uint64_t shared_fields_slot_bytes(int nx, int ny){
+    uint64_t bytes = sizeof(SharedFieldsSlot) + uint64_t(SHARED_FIELDS_CHANNELS)*nx*ny*sizeof(float);
+    return (bytes + 63)/64*64;
+}
+
+// A slot as a reader saw it, valid until still_valid() says otherwise.
+struct SharedFieldsView {
+    const SharedFieldsSlot *slot = nullptr;
+    uint64_t sequence = 0;
+    uint64_t frame = 0;
+    int64_t publish_ns = 0;
+    const float *density = nullptr;
+    const float *u = nullptr;
+    const float *v = nullptr;
+};
+
+struct SharedFieldsWriter {
+    char name[256] = {};
+    SharedFieldsHeader *header = nullptr;
+    size_t bytes = 0;
+
+    SharedFieldsWriter() = default;
+    SharedFieldsWriter(const SharedFieldsWriter&) = delete;
+    SharedFieldsWriter& operator = (const SharedFieldsWriter&) = delete;
+
+    ~SharedFieldsWriter(){
+        close();
+    }
+
+    bool is_open() const {
+        return header != nullptr;
+    }
+
+    // Creates the segment, replacing one of the same name. The name starts
+    // with a slash, e.g. "/fluid".
+    bool open(const char *name, int nx, int ny, int slots = 4){
+        close();
+#ifdef SHARED_FIELDS_SHM
+        uint64_t slot_bytes = shared_fields_slot_bytes(nx, ny);
+        bytes = sizeof(SharedFieldsHeader) + slots*slot_bytes;
+        shm_unlink(name);
+        int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+        if (fd < 0){
+            printf("Could not create shared memory %s\n", name);
+            return false;
+        }
+        void *p = MAP_FAILED;
+        if (ftruncate(fd, bytes) == 0){
+            p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        if (p == MAP_FAILED){
+            printf("Could not map shared memory %s\n", name);
+            shm_unlink(name);
+            return false;
+        }
+        snprintf(this->name, sizeof(this->name), "%s", name);
+
+        // the new segment is zero, so every slot starts out even and empty
+        header = (SharedFieldsHeader*)p;
+        header->version = SHARED_FIELDS_VERSION;
+        header->nx = nx;
+        header->ny = ny;
+        header->slots = slots;
+        header->slot_bytes = slot_bytes;
+        header->published.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(header->magic, SHARED_FIELDS_MAGIC, sizeof(SHARED_FIELDS_MAGIC));
+        return true;
+#else
+        (void)name; (void)nx; (void)ny; (void)slots;
+        printf("Shared memory is not supported on this platform\n");
+        return false;
+#endif
+    }
+
+    // unmaps and removes the segment, readers which have it mapped keep it
+    void close(){
+#ifdef SHARED_FIELDS_SHM
+        if (!header) return;
+        munmap(header, bytes);
+        shm_unlink(name);
+#endif
+        header = nullptr;
+    }
+
+    SharedFieldsSlot* slot(uint64_t index){
+        return (SharedFieldsSlot*)((char*)(header + 1) + index*header->slot_bytes);
+    }
+
+    // Copies the fields into the next slot of the ring, which readers of the
+    // oldest frame may still be looking at; they notice by the sequence.
+    template <typename T>
+    void publish(uint64_t frame, const Grid<T> &density, const Grid<T> &u, const Grid<T> &v){
+        if (!header) return;
+        int nx = header->nx;
+        int ny = header->ny;
+        uint64_t published = header->published.load(std::memory_order_relaxed);
+        SharedFieldsSlot *s = slot(published % header->slots);
+
+        uint64_t sequence = s->sequence.load(std::memory_order_relaxed);
+        s->sequence.store(sequence + 1, std::memory_order_relaxed);
+        // the odd sequence is visible before any of the new data
+        std::atomic_thread_fence(std::memory_order_release);
+
+        s->frame = frame;
+        float *out = (float*)(s + 1);
+        const Grid<T> *fields[SHARED_FIELDS_CHANNELS] = {&density, &u, &v};
+        for (const Grid<T> *field : fields){
+            for (int y = 0; y < ny; y++){
+                std::copy(field->row(y), field->row(y) + nx, out);
+                out += nx;
+            }
+        }
+        s->publish_ns = monotonic_ns();
+
+        s->sequence.store(sequence + 2, std::memory_order_release);
+        header->published.store(published + 1, std::memory_order_release);
+    }
+};
+
+struct SharedFieldsReader {
+    const SharedFieldsHeader *header = nullptr;
+    size_t bytes = 0;
+    int nx = 0, ny = 0;
+
+    SharedFieldsReader() = default;
+    SharedFieldsReader(const SharedFieldsReader&) = delete;
+    SharedFieldsReader& operator = (const SharedFieldsReader&) = delete;
+
+    ~SharedFieldsReader(){
+        close();
+    }
+
+    bool is_open() const {
+        return header != nullptr;
+    }
+
+    // false if there is no such segment or it is not ready yet
+    bool open(const char *name){
+        close();
+#ifdef SHARED_FIELDS_SHM
+        int fd = shm_open(name, O_RDONLY, 0);
+        if (fd < 0) return false;
+        struct stat st;
+        void *p = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(SharedFieldsHeader)){
+            p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        if (p == MAP_FAILED) return false;
+        header = (const SharedFieldsHeader*)p;
+        bytes = st.st_size;
+
+        bool ready = memcmp(header->magic, SHARED_FIELDS_MAGIC, sizeof(SHARED_FIELDS_MAGIC)) == 0;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (!ready || header->version != SHARED_FIELDS_VERSION ||
+            bytes < sizeof(SharedFieldsHeader) + header->slots*header->slot_bytes){
+            close();
+            return false;
+        }
+        nx = header->nx;
+        ny = header->ny;
+        return true;
+#else
+        (void)name;
+        return false;
+#endif
+    }
+
+    void close(){
+#ifdef SHARED_FIELDS_SHM
+        if (header) munmap((void*)header, bytes);
+#endif
+        header = nullptr;
+    }
+
+    uint64_t published() const {
+        return header->published.load(std::memory_order_acquire);
+    }
+
+    const SharedFieldsSlot* slot(uint64_t index) const {
+        return (const SharedFieldsSlot*)((const char*)(header + 1) + index*header->slot_bytes);
+    }
+
+    // The k-th published frame, counting from 0, false if it has not been
+    // published, has been overwritten or is being overwritten.
+    bool view(uint64_t k, SharedFieldsView &view) const {
+        if (k >= published() || published() - k > uint64_t(header->slots)) return false;
+        const SharedFieldsSlot *s = slot(k % header->slots);
+        uint64_t sequence = s->sequence.load(std::memory_order_acquire);
+        // the slot has been written k/slots + 1 times when it holds frame k
+        if (sequence != 2*(k/header->slots + 1)) return false;
+        size_t n = size_t(nx)*ny;
+        view.slot = s;
+        view.sequence = sequence;
+        view.frame = s->frame;
+        view.publish_ns = s->publish_ns;
+        view.density = (const float*)(s + 1);
+        view.u = view.density + n;
+        view.v = view.u + n;
+        return still_valid(view);
+    }
+
+    // the latest frame, false if there is none yet or the writer was quicker
+    bool latest(SharedFieldsView &view) const {
+        uint64_t n = published();
+        return n > 0 && this->view(n - 1, view);
+    }
+
+    // true if the slot has not been touched since view() or latest(), so
+    // whatever was read through the view until now is consistent
+    bool still_valid(const SharedFieldsView &view) const {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return view.slot->sequence.load(std::memory_order_relaxed) == view.sequence;
+    }
+
+    // Copies the latest frame out, any of the three may be null, trying
+    // again while the writer overwrites it. False if nothing is published.
+    bool read_latest(float *density, float *u, float *v, SharedFieldsView *info = nullptr) const {
+        size_t n = size_t(nx)*ny;
+        while (published() > 0){
+            SharedFieldsView view;
+            if (!latest(view)) continue;
+            if (density) memcpy(density, view.density, n*sizeof(float));
+            if (u) memcpy(u, view.u, n*sizeof(float));
+            if (v) memcpy(v, view.v, n*sizeof(float));
+            if (!still_valid(view)) continue;
+            if (info) *info = view;
+            return true;
+        }
+        return false;
+    }
+};
@@ -0,0 +1,50 @@
+#pragma once
+
+// Keeps simulated time in step with real time for a solver which advances
+// in steps of dt seconds. Real time accumulates and every step that runs
+// uses up its dt of it, so a late frame is made up by running several
+// steps, at most max_steps per advance(). Past that the solver cannot keep
+// up and the rest of the backlog is dropped: simulated time runs slow
+// rather than falling further and further behind.
+//
+//     clock.advance(real_seconds_since_last_call);
+//     while (clock.step_due(solver.dt)) solver.step();   // dt may change
+//     sleep(clock.wait(solver.dt));
+
+#include <algorithm>
+
+struct FixedStepClock {
+    int max_steps = 4;
+    // real time not yet simulated
+    double accumulator = 0.0;
+    int steps_this_advance = 0;
+
+    long steps = 0;
+    double simulated_seconds = 0.0;
+    double dropped_seconds = 0.0;
+
+    void advance(double seconds){
+        accumulator += seconds;
+        steps_this_advance = 0;
+    }
+
+    // true if a step of dt is due, which then counts as run
+    bool step_due(double dt){
+        if (accumulator < dt) return false;
+        if (steps_this_advance >= max_steps){
+            dropped_seconds += accumulator;
+            accumulator = 0.0;
+            return false;
+        }
+        accumulator -= dt;
+        steps_this_advance++;
+        steps++;
+        simulated_seconds += dt;
+        return true;
+    }
+
+    // real seconds until a step of dt is due
+    double wait(double dt) const {
+        return std::max(dt - accumulator, 0.0);
+    }
+};
@@ -0,0 +1,268 @@
+#pragma once
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include "grid.h"
+#include "half.h"
+#include "vec2.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+#include <immintrin.h>
+
+// integer registers to go with float4v, float8v and float16v
+typedef int int4v __attribute__((vector_size(16)));
+typedef int int8v __attribute__((vector_size(32)));
+typedef int int16v __attribute__((vector_size(64)));
+#endif
+
+// The solver kernels compiled for one instruction set, for velocity and
+// density stored as T (float, float16 or bfloat16). Pressure, divergence
+// and curl are always float. Every kernel works on rows [y0, y1) and
+// columns [x0, x1) of grids with a halo, so the solver can hand out bands
+// of rows to its thread pool.
+template <typename T>
+struct SimdKernels {
+    const char *name;
+    int lanes;
+
+    // dst[k] = src[k] traced back along (u, v) for k < count
+    void (*advect)(
+        const Grid<T> &u, const Grid<T> &v, float dt,
+        int count, const Grid<T> *const *src, Grid<T> *const *dst,
+        int y0, int y1, int x0, int x1);
+
+    void (*divergence)(
+        const Grid<T> &u, const Grid<T> &v, Grid<float> &div,
+        int y0, int y1, int x0, int x1);
+
+    // one Jacobi iteration p -> p2
+    void (*jacobi)(
+        const Grid<float> &p, const Grid<float> &div, Grid<float> &p2,
+        int y0, int y1, int x0, int x1);
+
+    void (*subtract_gradient)(
+        const Grid<float> &p, Grid<T> &u, Grid<T> &v,
+        int y0, int y1, int x0, int x1);
+
+    void (*abs_curl)(
+        const Grid<T> &u, const Grid<T> &v, Grid<float> &out,
+        int y0, int y1, int x0, int x1);
+
+    void (*confine_vorticity)(
+        const Grid<T> &u, const Grid<T> &v, const Grid<float> &abs_curl,
+        Grid<T> &new_u, Grid<T> &new_v, float dt, float vorticity,
+        int y0, int y1, int x0, int x1);
+
+    // largest squared speed
+    float (*max_speed2)(
+        const Grid<T> &u, const Grid<T> &v,
+        int y0, int y1, int x0, int x1);
+
+    // density to pixels through a lookup table, see Colormap in colormap.h
+    void (*colormap)(
+        const Grid<T> &density, const uint32_t *table, int size, float scale,
+        uint32_t *pixels, int width, int height,
+        int y0, int y1, int x0, int x1);
+
+    // n values from storage to floats and back
+    void (*load_row)(const T *src, float *dst, int n);
+    void (*store_row)(const float *src, T *dst, int n);
+};
+
+// one lane, also handles the columns left over by the wider versions
+namespace simd_scalar {
+    #define SIMD_LANES 1
+    #define SIMD_NAME "scalar"
+    typedef float floatv;
+    typedef int intv;
+
+    inline float gather(const float *base, int i){ return base[i]; }
+    inline bool all(int mask){ return mask != 0; }
+    inline float sqrtv(float x){ return sqrtf(x); }
+    inline float absv(float x){ return fabsf(x); }
+    inline float iota(){ return 0.0f; }
+    inline int floor_int(float x){ return floorf(x); }
+    inline float to_float(int i){ return i; }
+    inline int as_int(float x){ return float_bits(x); }
+    inline float as_float(int i){ return bits_float(i); }
+    inline int widen(const uint16_t *p){ return *p; }
+    inline void narrow(uint16_t *p, int i){ *p = i; }
+    inline int gather16(const uint16_t *base, int i){ return base[i]; }
+
+    #include "simd_kernels.h"
+    #undef SIMD_LANES
+    #undef SIMD_NAME
+}
+
+#ifdef SIMD_X86
+
+// helpers shared by the vector versions, V and I are matching float and int registers
+#define SIMD_VECTOR_HELPERS(V, I) \
+    VEC2_INLINE V iota(){ \
+        V v; \
+        for (int i = 0; i < SIMD_LANES; i++) v[i] = i; \
+        return v; \
+    } \
+    VEC2_INLINE V to_float(I i){ return __builtin_convertvector(i, V); } \
+    /* conversion truncates, step down where that rounded up */ \
+    VEC2_INLINE I floor_int(V x){ \
+        I i = __builtin_convertvector(x, I); \
+        return i + (I)(to_float(i) > x); \
+    } \
+    VEC2_INLINE V absv(V x){ return (V)((I)x & 0x7fffffff); } \
+    VEC2_INLINE I as_int(V x){ return (I)x; } \
+    VEC2_INLINE V as_float(I i){ return (V)i; } \
+    /* 16 bit values to and from the low halves of the int lanes */ \
+    typedef uint16_t ushortv __attribute__((vector_size(2*SIMD_LANES))); \
+    VEC2_INLINE I widen(const uint16_t *p){ \
+        ushortv s; \
+        memcpy(&s, p, sizeof(s)); \
+        return __builtin_convertvector(s, I); \
+    } \
+    VEC2_INLINE void narrow(uint16_t *p, I i){ \
+        ushortv s = __builtin_convertvector(i, ushortv); \
+        memcpy(p, &s, sizeof(s)); \
+    }
+
+// SSE2 is part of x86-64, so this is the baseline every CPU can run
+namespace simd_sse {
+    #define SIMD_LANES 4
+    #define SIMD_NAME "sse"
+    typedef float4v floatv;
+    typedef int4v intv;
+    SIMD_VECTOR_HELPERS(float4v, int4v)
+
+    // no gather instruction before AVX2
+    VEC2_INLINE float4v gather(const float *base, int4v i){
+        return float4v{base[i[0]], base[i[1]], base[i[2]], base[i[3]]};
+    }
+    VEC2_INLINE int4v gather16(const uint16_t *base, int4v i){
+        return int4v{base[i[0]], base[i[1]], base[i[2]], base[i[3]]};
+    }
+    VEC2_INLINE bool all(int4v mask){ return _mm_movemask_ps((__m128)mask) == 0xf; }
+    VEC2_INLINE float4v sqrtv(float4v x){ return _mm_sqrt_ps(x); }
+
+    #include "simd_kernels.h"
+    #undef SIMD_LANES
+    #undef SIMD_NAME
+}
+
+// Multiply-adds are not contracted to FMA, which would round differently,
+// so every instruction set gives the same results as the scalar kernels.
+// F16C converts float16 rows, it came with the first CPUs to have AVX2.
+#pragma GCC push_options
+#pragma GCC target("avx2,f16c")
+#pragma GCC optimize("fp-contract=off")
+namespace simd_avx2 {
+    #define SIMD_LANES 8
+    #define SIMD_NAME "avx2"
+    #define SIMD_F16C
+    typedef float8v floatv;
+    typedef int8v intv;
+    SIMD_VECTOR_HELPERS(float8v, int8v)
+
+    VEC2_INLINE float8v gather(const float *base, int8v i){
+        return _mm256_i32gather_ps(base, (__m256i)i, 4);
+    }
+    // 32 bits ending at each value, the 16 bits after the last one may not exist
+    VEC2_INLINE int8v gather16(const uint16_t *base, int8v i){
+        __m256i g = _mm256_i32gather_epi32((const int*)(base - 1), (__m256i)i, 2);
+        return ((int8v)g >> 16) & 0xffff;
+    }
+    VEC2_INLINE bool all(int8v mask){ return _mm256_movemask_ps((__m256)mask) == 0xff; }
+    VEC2_INLINE float8v sqrtv(float8v x){ return _mm256_sqrt_ps(x); }
+    VEC2_INLINE float8v load_half(const uint16_t *p){
+        return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)p));
+    }
+    VEC2_INLINE void store_half(uint16_t *p, float8v x){
+        _mm_storeu_si128((__m128i*)p, _mm256_cvtps_ph(x, _MM_FROUND_TO_NEAREST_INT));
+    }
+
+    #include "simd_kernels.h"
+    #undef SIMD_LANES
+    #undef SIMD_NAME
+    #undef SIMD_F16C
+}
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#pragma GCC optimize("fp-contract=off")
+namespace simd_avx512 {
+    #define SIMD_LANES 16
+    #define SIMD_NAME "avx512"
+    #define SIMD_F16C
+    typedef float16v floatv;
+    typedef int16v intv;
+    SIMD_VECTOR_HELPERS(float16v, int16v)
+
+    // the masked forms, the plain ones trip -Wmaybe-uninitialized in GCC 12
+    VEC2_INLINE float16v gather(const float *base, int16v i){
+        return _mm512_mask_i32gather_ps(_mm512_setzero_ps(), 0xffff, (__m512i)i, base, 4);
+    }
+    VEC2_INLINE int16v gather16(const uint16_t *base, int16v i){
+        __m512i g = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), 0xffff, (__m512i)i, (const int*)(base - 1), 2);
+        return ((int16v)g >> 16) & 0xffff;
+    }
+    VEC2_INLINE bool all(int16v mask){
+        return _mm512_cmpneq_epi32_mask((__m512i)mask, _mm512_setzero_si512()) == 0xffff;
+    }
+    VEC2_INLINE float16v sqrtv(float16v x){ return _mm512_maskz_sqrt_ps(0xffff, x); }
+    VEC2_INLINE float16v load_half(const uint16_t *p){
+        return _mm512_maskz_cvtph_ps(0xffff, _mm256_loadu_si256((const __m256i*)p));
+    }
+    VEC2_INLINE void store_half(uint16_t *p, float16v x){
+        _mm256_storeu_si256((__m256i*)p, _mm512_maskz_cvtps_ph(0xffff, x, _MM_FROUND_TO_NEAREST_INT));
+    }
+
+    #include "simd_kernels.h"
+    #undef SIMD_LANES
+    #undef SIMD_NAME
+    #undef SIMD_F16C
+}
+#pragma GCC pop_options
+
+#undef SIMD_VECTOR_HELPERS
+
+#endif
+
+enum SimdLevel {
+    SIMD_SCALAR,
+    SIMD_SSE,
+    SIMD_AVX2,
+    SIMD_AVX512,
+};
+
+// widest instruction set the CPU supports
+SimdLevel best_simd_level(){
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return SIMD_AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c")) return SIMD_AVX2;
+    return SIMD_SSE;
+#else
+    return SIMD_SCALAR;
+#endif
+}
+
+// kernels for the given level, or the best one below it which was compiled in
+template <typename T = float>
+const SimdKernels<T>* get_simd_kernels(SimdLevel level){
+#ifdef SIMD_X86
+    switch (level){
+        case SIMD_AVX512: return &simd_avx512::kernels<T>;
+        case SIMD_AVX2: return &simd_avx2::kernels<T>;
+        case SIMD_SSE: return &simd_sse::kernels<T>;
+        case SIMD_SCALAR: break;
+    }
+#endif
+    (void)level;
+    return &simd_scalar::kernels<T>;
+}
+
+template <typename T = float>
+const SimdKernels<T>* get_simd_kernels(){
+    return get_simd_kernels<T>(best_simd_level());
+}
@@ -0,0 +1,411 @@
+// Solver kernels written once for any number of lanes. simd.h includes
+// this file several times, each time inside a namespace which defines
+//
+//     SIMD_LANES               number of floats per register
+//     floatv, intv             register of SIMD_LANES floats and ints
+//     gather(base, index)      base[index] for each lane
+//     all(mask)                true if the comparison held in every lane
+//     sqrtv(x), absv(x)        square root and absolute value of each lane
+//     iota()                   0, 1, 2, ... SIMD_LANES - 1
+//     floor_int(x), to_float(i)
+//     as_int(x), as_float(i)   the same bits as the other type
+//     widen(p), narrow(p, i)   SIMD_LANES uint16_t to and from int lanes
+//     gather16(base, index)    base[index] for uint16_t, widened
+//     load_half, store_half    float16 conversions, if SIMD_F16C is defined
+//
+// and compiles it for the matching instruction set. Each kernel handles
+// rows [y0, y1) and columns [x0, x1); columns which do not fill a whole
+// register are left to the scalar version of the kernel. The kernels are
+// templates on the storage type of the velocity and density grids, the
+// load, store and gather overloads below convert it to and from floats.
+
+#if SIMD_LANES > 1
+#define SIMD_TAIL(call) if (x < x1) simd_scalar::call
+#else
+#define SIMD_TAIL(call)
+#endif
+
+VEC2_INLINE floatv load(const float *p){
+    floatv v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+VEC2_INLINE void store(float *p, floatv v){
+    memcpy(p, &v, sizeof(v));
+}
+
+VEC2_INLINE void store(uint32_t *p, intv v){
+    memcpy(p, &v, sizeof(v));
+}
+
+// same as half_bits_to_float() and float_to_half_bits() in half.h
+VEC2_INLINE floatv half_to_float(intv h){
+    intv x = (h & 0x7fff) << 13;
+    intv bits = as_int(as_float(x)*0x1p112f);
+    intv special = x > 0x0f800000 ? intv{} + 0x7fc00000 : intv{} + 0x7f800000;
+    bits |= x >= 0x0f800000 ? special : intv{};
+    return as_float(bits | (h & 0x8000) << 16);
+}
+
+VEC2_INLINE intv float_to_half(floatv f){
+    intv x = as_int(f);
+    intv sign = (x >> 16) & 0x8000;
+    x &= 0x7fffffff;
+    intv normal = (x - ((112 << 23) - 0xfff) + ((x >> 13) & 1)) >> 13;
+    intv denormal = as_int(as_float(x) + 0.5f) - 0x3f000000;
+    intv special = x > 0x7f800000 ? (x >> 13 & 0x3ff) | 0x7e00 : intv{} + 0x7c00;
+    intv h = x < 0x38800000 ? denormal : normal;
+    h = x >= 0x47800000 ? special : h;
+    return h | sign;
+}
+
+// NaN is left out of the rounding, where the sum could overflow
+VEC2_INLINE intv float_to_bfloat16(floatv f){
+    intv x = as_int(f);
+    intv y = x & 0x7fffffff;
+    intv nan = y > 0x7f800000;
+    intv finite = nan ? intv{} : y;
+    intv h = (finite + 0x7fff + ((finite >> 16) & 1)) >> 16;
+    h = nan ? (y >> 16) | 0x40 : h;
+    return h | ((x >> 16) & 0x8000);
+}
+
+VEC2_INLINE floatv load(const float16 *p){
+#ifdef SIMD_F16C
+    return load_half(&p->bits);
+#else
+    return half_to_float(widen(&p->bits));
+#endif
+}
+
+VEC2_INLINE void store(float16 *p, floatv v){
+#ifdef SIMD_F16C
+    store_half(&p->bits, v);
+#else
+    narrow(&p->bits, float_to_half(v));
+#endif
+}
+
+VEC2_INLINE floatv load(const bfloat16 *p){
+    return as_float(widen(&p->bits) << 16);
+}
+
+VEC2_INLINE void store(bfloat16 *p, floatv v){
+    narrow(&p->bits, float_to_bfloat16(v));
+}
+
+VEC2_INLINE floatv gather(const float16 *base, intv i){
+    return half_to_float(gather16(&base->bits, i));
+}
+
+VEC2_INLINE floatv gather(const bfloat16 *base, intv i){
+    return as_float(gather16(&base->bits, i) << 16);
+}
+
+VEC2_INLINE floatv broadcast(float a){
+    return floatv{} + a;
+}
+
+VEC2_INLINE floatv select(intv mask, floatv a, floatv b){
+    return mask ? a : b;
+}
+
+VEC2_INLINE floatv lerpv(floatv a, floatv b, floatv u){
+    return (1.0f - u)*a + u*b;
+}
+
+// one cell which leaves the halo, same as FluidSolver::advect_*
+template <typename T>
+void advect_cell(
+    const Grid<T> &u, const Grid<T> &v, float dt,
+    int count, const Grid<T> *const *src, Grid<T> *const *dst,
+    int x, int y
+){
+    vec2f pos = v2f(x, y) - dt*vec2f{u(x, y), v(x, y)};
+    for (int k = 0; k < count; k++){
+        (*dst[k])(x, y) = interpolate(*src[k], pos);
+    }
+}
+
+// Semi-Lagrangian advection of count fields by (u, v). The back-traced
+// position is shared by all fields, the four taps are gathered.
+template <typename T>
+void advect(
+    const Grid<T> &u, const Grid<T> &v, float dt,
+    int count, const Grid<T> *const *src, Grid<T> *const *dst,
+    int y0, int y1, int x0, int x1
+){
+    int nx = u.nx;
+    int ny = u.ny;
+    int stride = u.stride;
+
+    for (int y = y0; y < y1; y++){
+        const T *ur = u.row(y);
+        const T *vr = v.row(y);
+        int x = x0;
+        for (; x + SIMD_LANES <= x1; x += SIMD_LANES){
+            vec2v<floatv> cell = {broadcast(x) + iota(), broadcast(y)};
+            vec2v<floatv> velocity = {load(ur + x), load(vr + x)};
+            vec2v<floatv> pos = cell - dt*velocity;
+
+            intv ix = floor_int(pos.x);
+            intv iy = floor_int(pos.y);
+            intv inside = (ix >= -1) & (ix < nx) & (iy >= -1) & (iy < ny);
+
+            if (!all(inside)){
+                for (int i = 0; i < SIMD_LANES; i++){
+                    advect_cell(u, v, dt, count, src, dst, x + i, y);
+                }
+                continue;
+            }
+
+            floatv ux = pos.x - to_float(ix);
+            floatv uy = pos.y - to_float(iy);
+            intv index = ix + iy*stride;
+
+            for (int k = 0; k < count; k++){
+                const T *base = src[k]->values;
+                floatv a = gather(base, index);
+                floatv b = gather(base, index + 1);
+                floatv c = gather(base, index + stride);
+                floatv d = gather(base, index + stride + 1);
+                store(dst[k]->row(y) + x, lerpv(lerpv(a, b, ux), lerpv(c, d, ux), uy));
+            }
+        }
+        SIMD_TAIL(advect(u, v, dt, count, src, dst, y, y + 1, x, x1));
+    }
+}
+
+template <typename T>
+void divergence(
+    const Grid<T> &u, const Grid<T> &v, Grid<float> &div,
+    int y0, int y1, int x0, int x1
+){
+    for (int y = y0; y < y1; y++){
+        const T *u0 = u.row(y);
+        const T *v_down = v.row(y - 1);
+        const T *v_up = v.row(y + 1);
+        float *out = div.row(y);
+        int x = x0;
+        for (; x + SIMD_LANES <= x1; x += SIMD_LANES){
+            floatv dx = load(u0 + x + 1) - load(u0 + x - 1);
+            floatv dy = load(v_up + x) - load(v_down + x);
+            store(out + x, dx + dy);
+        }
+        SIMD_TAIL(divergence(u, v, div, y, y + 1, x, x1));
+    }
+}
+
+void jacobi(
+    const Grid<float> &p, const Grid<float> &div, Grid<float> &p2,
+    int y0, int y1, int x0, int x1
+){
+    for (int y = y0; y < y1; y++){
+        const float *p0 = p.row(y);
+        const float *p_down = p.row(y - 1);
+        const float *p_up = p.row(y + 1);
+        const float *d = div.row(y);
+        float *out = p2.row(y);
+        int x = x0;
+        for (; x + SIMD_LANES <= x1; x += SIMD_LANES){
+            floatv sum = -load(d + x)
+                + load(p0 + x + 1)
+                + load(p0 + x - 1)
+                + load(p_up + x)
+                + load(p_down + x);
+            store(out + x, 0.25f*sum);
+        }
+        SIMD_TAIL(jacobi(p, div, p2, y, y + 1, x, x1));
+    }
+}
+
+template <typename T>
+void subtract_gradient(
+    const Grid<float> &p, Grid<T> &u, Grid<T> &v,
+    int y0, int y1, int x0, int x1
+){
+    for (int y = y0; y < y1; y++){
+        const float *p0 = p.row(y);
+        const float *p_down = p.row(y - 1);
+        const float *p_up = p.row(y + 1);
+        T *ur = u.row(y);
+        T *vr = v.row(y);
+        int x = x0;
+        for (; x + SIMD_LANES <= x1; x += SIMD_LANES){
+            store(ur + x, load(ur + x) - 0.5f*(load(p0 + x + 1) - load(p0 + x - 1)));
+            store(vr + x, load(vr + x) - 0.5f*(load(p_up + x) - load(p_down + x)));
+        }
+        SIMD_TAIL(subtract_gradient(p, u, v, y, y + 1, x, x1));
+    }
+}
+
+template <typename T>
+VEC2_INLINE floatv curl(const T *u_down, const T *u_up, const T *v0, int x){
+    return
+        load(u_up + x) - load(u_down + x) +
+        load(v0 + x - 1) - load(v0 + x + 1);
+}
+
+template <typename T>
+void abs_curl(
+    const Grid<T> &u, const Grid<T> &v, Grid<float> &out,
+    int y0, int y1, int x0, int x1
+){
+    for (int y = y0; y < y1; y++){
+        const T *u_down = u.row(y - 1);
+        const T *u_up = u.row(y + 1);
+        const T *v0 = v.row(y);
+        float *o = out.row(y);
+        int x = x0;
+        for (; x + SIMD_LANES <= x1; x += SIMD_LANES){
+            floatv c = curl(u_down, u_up, v0, x);
+            store(o + x, absv(c));
+        }
+        SIMD_TAIL(abs_curl(u, v, out, y, y + 1, x, x1));
+    }
+}
+
+// vorticity confinement force, only applied in the right half of the grid
+template <typename T>
+void confine_vorticity(
+    const Grid<T> &u, const Grid<T> &v, const Grid<float> &abs_curl,
+    Grid<T> &new_u, Grid<T> &new_v, float dt, float vorticity,
+    int y0, int y1, int x0, int x1
+){
+    float middle = u.nx/2;
+    for (int y = y0; y < y1; y++){
+        const T *u0 = u.row(y);
+        const T *u_down = u.row(y - 1);
+        const T *u_up = u.row(y + 1);
+        const T *v0 = v.row(y);
+        const float *c0 = abs_curl.row(y);
+        const float *c_down = abs_curl.row(y - 1);
+        const float *c_up = abs_curl.row(y + 1);
+        T *out_u = new_u.row(y);
+        T *out_v = new_v.row(y);
+        int x = x0;
+        for (; x + SIMD_LANES <= x1; x += SIMD_LANES){
+            vec2v<floatv> direction;
+            direction.x = load(c_down + x) - load(c_up + x);
+            direction.y = load(c0 + x + 1) - load(c0 + x - 1);
+
+            // not dot(), which returns a bare vector and GCC notes its ABI at the
+            // end of the file, outside the pragma of vec2.h
+            floatv length2 = direction.x*direction.x + direction.y*direction.y;
+            direction = vorticity/(sqrtv(length2) + 1e-5f) * direction;
+
+            floatv keep = select(broadcast(x) + iota() < middle, broadcast(0.0f), broadcast(1.0f));
+            direction = keep*direction;
+
+            floatv force = dt*curl(u_down, u_up, v0, x);
+            store(out_u + x, load(u0 + x) + force*direction.x);
+            store(out_v + x, load(v0 + x) + force*direction.y);
+        }
+        SIMD_TAIL(confine_vorticity(u, v, abs_curl, new_u, new_v, dt, vorticity, y, y + 1, x, x1));
+    }
+}
+
+// largest u*u + v*v, NaN is ignored
+template <typename T>
+float max_speed2(const Grid<T> &u, const Grid<T> &v, int y0, int y1, int x0, int x1){
+    floatv m = broadcast(0.0f);
+    float tail = 0.0f;
+    for (int y = y0; y < y1; y++){
+        const T *ur = u.row(y);
+        const T *vr = v.row(y);
+        int x = x0;
+        for (; x + SIMD_LANES <= x1; x += SIMD_LANES){
+            floatv a = load(ur + x);
+            floatv b = load(vr + x);
+            floatv s = a*a + b*b;
+            m = select(s > m, s, m);
+        }
+        if (x < x1) tail = std::max(tail, simd_scalar::max_speed2(u, v, y, y + 1, x, x1));
+    }
+    float lanes[SIMD_LANES];
+    memcpy(lanes, &m, sizeof(lanes));
+    for (float l : lanes) tail = std::max(tail, l);
+    return tail;
+}
+
+// Pixels of rows [y0, y1) of a width x height image of the density, whose
+// value d picks table[clamp(int(d*scale), 0, size - 1)]. Where the image
+// is not the size of the grid, pixel centers are mapped to the grid and
+// the density is interpolated there, reading the halo at the borders.
+template <typename T>
+void colormap(
+    const Grid<T> &density, const uint32_t *table, int size, float scale,
+    uint32_t *pixels, int width, int height,
+    int y0, int y1, int x0, int x1
+){
+    int nx = density.nx;
+    int ny = density.ny;
+    bool resample = width != nx || height != ny;
+    float sx = float(nx)/width;
+    float sy = float(ny)/height;
+    float limit = size - 1;
+    // the colors are gathered as floats, the bits pass through unchanged
+    const float *colors = (const float*)table;
+
+    for (int y = y0; y < y1; y++){
+        uint32_t *out = pixels + size_t(y)*width;
+        float gy = (y + 0.5f)*sy - 0.5f;
+        int iy = floorf(gy);
+        floatv uy = broadcast(gy - iy);
+        const T *row0 = density.row(iy);
+        const T *row1 = density.row(iy + 1);
+        int x = x0;
+        for (; x + SIMD_LANES <= x1; x += SIMD_LANES){
+            floatv d;
+            if (resample){
+                floatv gx = (broadcast(x) + iota() + 0.5f)*sx - 0.5f;
+                intv ix = floor_int(gx);
+                floatv ux = gx - to_float(ix);
+                floatv a = lerpv(gather(row0, ix), gather(row0, ix + 1), ux);
+                floatv b = lerpv(gather(row1, ix), gather(row1, ix + 1), ux);
+                d = lerpv(a, b, uy);
+            } else {
+                d = load(row0 + x);
+            }
+            // NaN goes to the first color
+            floatv f = d*scale;
+            f = select(f > 0.0f, f, broadcast(0.0f));
+            f = select(f < limit, f, broadcast(limit));
+            store(out + x, as_int(gather(colors, floor_int(f))));
+        }
+        SIMD_TAIL(colormap(density, table, size, scale, pixels, width, height, y, y + 1, x, x1));
+    }
+}
+
+template <typename T>
+void load_row(const T *src, float *dst, int n){
+    int x = 0;
+    for (; x + SIMD_LANES <= n; x += SIMD_LANES) store(dst + x, load(src + x));
+    for (; x < n; x++) dst[x] = src[x];
+}
+
+template <typename T>
+void store_row(const float *src, T *dst, int n){
+    int x = 0;
+    for (; x + SIMD_LANES <= n; x += SIMD_LANES) store(dst + x, load(src + x));
+    for (; x < n; x++) dst[x] = src[x];
+}
+
+template <typename T>
+const SimdKernels<T> kernels = {
+    SIMD_NAME,
+    SIMD_LANES,
+    advect<T>,
+    divergence<T>,
+    jacobi,
+    subtract_gradient<T>,
+    abs_curl<T>,
+    confine_vorticity<T>,
+    max_speed2<T>,
+    colormap<T>,
+    load_row<T>,
+    store_row<T>,
+};
+
+#undef SIMD_TAIL
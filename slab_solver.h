@@ -0,0 +1,149 @@
+#pragma once
+
+// One horizontal slab of a periodic domain too large for one process.
+// Rank r of the transport owns the domain rows [r*ny/size, (r + 1)*ny/size)
+// and keeps halo more rows on either side, copies of its neighbours' rows
+// which are exchanged once before every step. The step then runs over the
+// whole slab, ghost rows included, as an ordinary FluidSolver on a short
+// periodic grid: wrong values come in at the slab's ends and spread one row
+// per stencil pass, and as far as the advection traces back, but do not
+// reach the owned rows as long as the halo is at least
+//
+//     2 rows for vorticity confinement, abs_curl() and the force
+//     + the backtrace of the velocity advection, see reach()
+//     + 1 + iterations + 1 rows for divergence, Jacobi and the gradient
+//
+// so the density advection, which traces back along the projected velocity,
+// is covered as well. The ghost rows are computed twice in exchange for a
+// single exchange per step. The owned rows match an undivided solver up to
+// rounding, since the backtrace adds the velocity to slab rather than
+// domain coordinates. The pressure solve has to be Jacobi; multigrid and
+// the FFT solve the whole domain at once.
+
+#include <math.h>
+#include <algorithm>
+#include "fluid_solver.h"
+#include "transport.h"
+#include "timer.h"
+
+struct SlabSolver {
+    Transport &transport;
+    // of the whole domain
+    int nx, ny;
+    // owned rows of the domain
+    int y0, y1;
+    int halo;
+    // over rows y0 - halo to y1 + halo of the domain
+    FluidSolver solver;
+
+    // With cfl > 0, the time step is picked as in FluidSolver, from the
+    // fastest cell of the whole domain.
+    float cfl = 0.0f;
+    // of the whole domain after the last step
+    float max_speed = 0.0f;
+    // seconds spent in exchange_halo() and all_reduce()
+    double exchange_time = 0.0;
+    // set when step() failed because of the velocity, not the transport
+    bool too_fast = false;
+
+    SlabSolver(
+        Transport &transport, int nx, int ny, int halo,
+        float dt = 0.02f, int iterations = 5, float vorticity = 10.0f,
+        ThreadPool *pool = nullptr
+    ):
+        transport(transport),
+        nx(nx), ny(ny),
+        y0(transport.rank*ny/transport.size),
+        y1((transport.rank + 1)*ny/transport.size),
+        halo(halo),
+        solver(nx, y1 - y0 + 2*halo, dt, iterations, vorticity, pool)
+    {
+        solver.y_offset = y0 - halo;
+        solver.domain_ny = ny;
+        solver.pressure = PRESSURE_JACOBI;
+    }
+
+    // the smallest halo which allows a backtrace of reach rows
+    static int min_halo(int reach, int iterations){
+        return 2 + reach + 1 + iterations + 1;
+    }
+
+    // rows the velocity may move in one step with this halo, including the
+    // one row the bilinear taps reach past the traced back position
+    int reach() const {
+        return halo - min_halo(0, solver.iterations);
+    }
+
+    int rows() const {
+        return y1 - y0;
+    }
+
+    // row y of the domain, y in [y0, y1)
+    const float* density_row(int y) const {
+        return solver.old_density.row(y - y0 + halo);
+    }
+
+    // Sends the owned rows at either end to the neighbours and receives
+    // theirs into the ghost rows. The rows of a grid are contiguous, so each
+    // grid goes as it is, two messages of halo rows each.
+    bool exchange_halo(){
+        double t = sec();
+        Grid<float> *grids[] = {&solver.old_u, &solver.old_v, &solver.old_density};
+        for (Grid<float> *grid : grids){
+            size_t bytes = sizeof(float)*grid->stride*halo;
+            int top = halo + rows();
+            // own top rows up, the lower neighbour's into the bottom ghost rows
+            if (!transport.exchange(transport.up(), grid->row(top - halo), transport.down(), grid->row(0), bytes)) return false;
+            // own bottom rows down, the upper neighbour's into the top ghost rows
+            if (!transport.exchange(transport.down(), grid->row(halo), transport.up(), grid->row(top), bytes)) return false;
+            grid->fill_halo();
+        }
+        exchange_time += sec() - t;
+        return true;
+    }
+
+    // largest speed of the owned rows of all ranks
+    bool update_max_speed(){
+        double speed = solver.simd->max_speed2(solver.old_u, solver.old_v, halo, halo + rows(), 0, nx);
+        double t = sec();
+        if (!all_reduce(transport, speed, [](double a, double b){ return std::max(a, b); })) return false;
+        exchange_time += sec() - t;
+        max_speed = sqrtf(speed);
+        return true;
+    }
+
+    // False if the transport failed, or if the velocity has come too close
+    // to moving further than the halo covers, with a quarter of the reach
+    // to spare for the forcing of the next step. Every rank sees the same
+    // largest speed, so all of them stop at the same step.
+    bool step(){
+        if (!exchange_halo()) return false;
+        float dt = solver.dt;
+        solver.step();
+        if (!update_max_speed()) return false;
+        if (cfl > 0.0f){
+            float t = max_speed > 0.0f ? cfl/max_speed : solver.max_dt;
+            solver.dt = clamp(t, solver.min_dt, solver.max_dt);
+        }
+        float moved = max_speed*std::max(dt, solver.dt);
+        too_fast = moved*1.25f + 1.0f > reach();
+        return !too_fast;
+    }
+
+    // of the owned rows, the ranks add theirs together
+    double density_sum() const {
+        double sum = 0.0;
+        for (int y = y0; y < y1; y++){
+            const float *row = density_row(y);
+            for (int x = 0; x < nx; x++) sum += row[x];
+        }
+        return sum;
+    }
+
+    // grids and scratch memory of this rank
+    size_t memory_bytes() const {
+        size_t bytes = 6*Grid<float>::storage_size(nx, solver.ny);
+        for (const Workspace::Block &block : solver.workspace->blocks) bytes += block.bytes;
+        return bytes;
+    }
+};
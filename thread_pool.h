@@ -0,0 +1,154 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "profiler.h"
+#include "perf_counters.h"
+
+// Persistent worker threads which split a range of rows into bands.
+// Each thread starts with its own contiguous share of the bands and steals
+// bands from the other threads once its share is exhausted.
+// The calling thread participates as worker 0.
+struct ThreadPool {
+    typedef void (*TaskFunction)(void *context, int begin, int end);
+
+    struct alignas(64) Queue {
+        std::atomic<int> next;
+        int end;
+    };
+
+    int num_threads;
+    std::vector<std::thread> threads;
+    std::vector<Queue> queues;
+
+    std::mutex mutex;
+    std::condition_variable start_condition;
+    std::condition_variable done_condition;
+    int generation = 0;
+    int running = 0;
+    bool quit = false;
+
+    TaskFunction task_function = nullptr;
+    void *task_context = nullptr;
+    int task_begin = 0;
+    int task_end = 0;
+    int task_grain = 1;
+
+    ThreadPool(int num_threads = 0): queues(default_threads(num_threads)){
+        this->num_threads = queues.size();
+        for (int i = 1; i < this->num_threads; i++){
+            threads.emplace_back(&ThreadPool::worker_loop, this, i);
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator = (const ThreadPool&) = delete;
+
+    ~ThreadPool(){
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        start_condition.notify_all();
+        for (std::thread &thread : threads) thread.join();
+    }
+
+    static int default_threads(int num_threads){
+        if (num_threads > 0) return num_threads;
+        int n = std::thread::hardware_concurrency();
+        return n > 0 ? n : 1;
+    }
+
+    int size() const {
+        return num_threads;
+    }
+
+    // Calls function(context, b0, b1) for disjoint bands covering [begin, end).
+    void run(TaskFunction function, void *context, int begin, int end, int grain = 0){
+        int n = end - begin;
+        if (n <= 0) return;
+
+        if (num_threads == 1 || n == 1){
+            function(context, begin, end);
+            return;
+        }
+
+        // about four bands per thread, so stealing can balance uneven bands
+        if (grain <= 0) grain = std::max(1, n/(4*num_threads));
+        int num_bands = (n + grain - 1)/grain;
+
+        for (int i = 0; i < num_threads; i++){
+            queues[i].next.store(i*num_bands/num_threads, std::memory_order_relaxed);
+            queues[i].end = (i + 1)*num_bands/num_threads;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            task_function = function;
+            task_context = context;
+            task_begin = begin;
+            task_end = end;
+            task_grain = grain;
+            running = num_threads - 1;
+            generation++;
+        }
+        start_condition.notify_all();
+
+        work(0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done_condition.wait(lock, [this]{ return running == 0; });
+    }
+
+    void work(int thread_index){
+        perf_monitor.attach_thread();
+        for (int k = 0; k < num_threads; k++){
+            Queue &queue = queues[(thread_index + k) % num_threads];
+            while (true){
+                int band = queue.next.fetch_add(1, std::memory_order_relaxed);
+                if (band >= queue.end) break;
+                int b0 = task_begin + band*task_grain;
+                int b1 = std::min(b0 + task_grain, task_end);
+                PROFILE_SCOPE("band");
+                task_function(task_context, b0, b1);
+            }
+        }
+    }
+
+    void worker_loop(int thread_index){
+        int seen = 0;
+        while (true){
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                start_condition.wait(lock, [&]{ return quit || generation != seen; });
+                if (quit) return;
+                seen = generation;
+            }
+
+            work(thread_index);
+
+            bool last;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                last = --running == 0;
+            }
+            if (last) done_condition.notify_one();
+        }
+    }
+};
+
+// Calls f(b0, b1) on bands of [begin, end), serially if pool is null.
+template <typename F>
+void parallel_for(ThreadPool *pool, int begin, int end, F f, int grain = 0){
+    if (!pool){
+        f(begin, end);
+        return;
+    }
+    pool->run([](void *context, int b0, int b1){
+        (*(F*)context)(b0, b1);
+    }, &f, begin, end, grain);
+}
@@ -0,0 +1,239 @@
+#pragma once
+
+// Moves ghost rows between the processes of a decomposed solver, see
+// slab_solver.h. The ranks 0 to size - 1 form a ring and each talks only
+// to its two neighbours. A transport is set up in the launching process
+// and inherited by the ranks it forks, which then call attach() with
+// their rank: shared memory and Unix sockets on one machine, standing in
+// for the interconnect of a cluster.
+//
+//     SharedMemoryTransport transport(ranks, 1 << 20);
+//     for (int r = 0; r < ranks; r++) if (fork() == 0){
+//         transport.attach(r);
+//         ...
+//     }
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <vector>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+struct Transport {
+    int rank = 0;
+    int size = 1;
+
+    virtual ~Transport(){}
+
+    // called once in each process after it has been forked
+    virtual void attach(int rank) = 0;
+
+    // Sends bytes from send to rank to and receives as many from rank from
+    // into recv, both at the same time, so that neighbours which exchange
+    // with each other do not wait on each other. Every rank has to make
+    // the same sequence of calls. False if the connection broke.
+    virtual bool exchange(int to, const void *send, int from, void *recv, size_t bytes) = 0;
+
+    int up() const {
+        return (rank + 1) % size;
+    }
+
+    int down() const {
+        return (rank + size - 1) % size;
+    }
+};
+
+// Combines value over all ranks with op, which has to be commutative, and
+// leaves the result on every rank. Each value travels once around the
+// ring, in size - 1 exchanges.
+template <typename F>
+bool all_reduce(Transport &transport, double &value, F op){
+    double forward = value;
+    for (int k = 1; k < transport.size; k++){
+        double received;
+        if (!transport.exchange(transport.up(), &forward, transport.down(), &received, sizeof(received))) return false;
+        value = op(value, received);
+        forward = received;
+    }
+    return true;
+}
+
+// One mailbox from each rank to each of its neighbours in a shared
+// anonymous mapping. A message larger than a mailbox goes in chunks, the
+// sender waits for the receiver to empty the mailbox before the next one.
+// Waiting spins with sched_yield(), so ranks should not outnumber cores.
+struct SharedMemoryTransport: Transport {
+    struct alignas(64) Mailbox {
+        // set while the chunk has not been copied out
+        std::atomic<uint32_t> full;
+        uint32_t bytes;
+    };
+
+    size_t capacity;
+    // bytes from one mailbox to the next, its header and chunk
+    size_t mailbox_bytes;
+    char *memory = nullptr;
+    size_t memory_bytes = 0;
+
+    SharedMemoryTransport(int size, size_t capacity = 1 << 20):
+        capacity(capacity),
+        mailbox_bytes(sizeof(Mailbox) + (capacity + 63)/64*64)
+    {
+        this->size = size;
+        memory_bytes = 2*size*mailbox_bytes;
+        void *p = mmap(nullptr, memory_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED){
+            memory_bytes = 0;
+            return;
+        }
+        memory = (char*)p;
+        for (int i = 0; i < 2*size; i++) new (memory + i*mailbox_bytes) Mailbox{{0}, 0};
+    }
+
+    SharedMemoryTransport(const SharedMemoryTransport&) = delete;
+    SharedMemoryTransport& operator = (const SharedMemoryTransport&) = delete;
+
+    ~SharedMemoryTransport(){
+        if (memory) munmap(memory, memory_bytes);
+    }
+
+    bool is_open() const {
+        return memory != nullptr;
+    }
+
+    void attach(int rank) override {
+        this->rank = rank;
+    }
+
+    // with two ranks both neighbours are the same one and share the mailbox
+    Mailbox* mailbox(int from, int to){
+        int i = 2*from + (to == (from + 1) % size ? 0 : 1);
+        return (Mailbox*)(memory + i*mailbox_bytes);
+    }
+
+    static char* chunk(Mailbox *mailbox){
+        return (char*)(mailbox + 1);
+    }
+
+    bool exchange(int to, const void *send, int from, void *recv, size_t bytes) override {
+        if (to == rank && from == rank){
+            memcpy(recv, send, bytes);
+            return true;
+        }
+        Mailbox *out = mailbox(rank, to);
+        Mailbox *in = mailbox(from, rank);
+        size_t sent = 0;
+        size_t received = 0;
+        while (sent < bytes || received < bytes){
+            bool progress = false;
+            if (sent < bytes && !out->full.load(std::memory_order_acquire)){
+                size_t n = std::min(capacity, bytes - sent);
+                memcpy(chunk(out), (const char*)send + sent, n);
+                out->bytes = n;
+                out->full.store(1, std::memory_order_release);
+                sent += n;
+                progress = true;
+            }
+            if (received < bytes && in->full.load(std::memory_order_acquire)){
+                memcpy((char*)recv + received, chunk(in), in->bytes);
+                received += in->bytes;
+                in->full.store(0, std::memory_order_release);
+                progress = true;
+            }
+            if (!progress) sched_yield();
+        }
+        return true;
+    }
+};
+
+// A stream socket pair between each two neighbours, written and read
+// without blocking so both directions of an exchange make progress.
+struct SocketTransport: Transport {
+    // ends of the pair of ring edge e, between ranks e and e + 1: [2*e] for
+    // rank e, [2*e + 1] for rank e + 1, -1 if there is none
+    std::vector<int> fds;
+
+    SocketTransport(int size): fds(2*size, -1){
+        this->size = size;
+        // with two ranks both edges join the same pair of ranks
+        int edges = size > 2 ? size : size - 1;
+        for (int e = 0; e < edges; e++){
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, &fds[2*e]) != 0){
+                fds[2*e] = fds[2*e + 1] = -1;
+            }
+        }
+    }
+
+    SocketTransport(const SocketTransport&) = delete;
+    SocketTransport& operator = (const SocketTransport&) = delete;
+
+    ~SocketTransport(){
+        for (int fd : fds) if (fd >= 0) close(fd);
+    }
+
+    bool is_open() const {
+        int edges = size > 2 ? size : size - 1;
+        for (int i = 0; i < 2*edges; i++) if (fds[i] < 0) return false;
+        return true;
+    }
+
+    int& fd(int peer){
+        if (peer == up() && !(size == 2 && rank == 1)) return fds[2*rank];
+        return fds[2*peer + 1];
+    }
+
+    // closes the ends of the other ranks
+    void attach(int rank) override {
+        this->rank = rank;
+        if (size == 1) return;
+        int own[2] = {fd(up()), fd(down())};
+        for (int &f : fds){
+            if (f >= 0 && f != own[0] && f != own[1]){
+                close(f);
+                f = -1;
+            }
+        }
+        for (int f : own) fcntl(f, F_SETFL, fcntl(f, F_GETFL) | O_NONBLOCK);
+    }
+
+    bool exchange(int to, const void *send, int from, void *recv, size_t bytes) override {
+        if (to == rank && from == rank){
+            memcpy(recv, send, bytes);
+            return true;
+        }
+        int out = fd(to);
+        int in = fd(from);
+        size_t sent = 0;
+        size_t received = 0;
+        while (sent < bytes || received < bytes){
+            pollfd polls[2];
+            int n = 0;
+            if (sent < bytes) polls[n++] = {out, POLLOUT, 0};
+            if (received < bytes) polls[n++] = {in, POLLIN, 0};
+            if (poll(polls, n, -1) < 0){
+                if (errno == EINTR) continue;
+                return false;
+            }
+            if (sent < bytes){
+                ssize_t k = write(out, (const char*)send + sent, bytes - sent);
+                if (k > 0) sent += k;
+                else if (k < 0 && errno != EAGAIN && errno != EINTR) return false;
+            }
+            if (received < bytes){
+                ssize_t k = read(in, (char*)recv + received, bytes - received);
+                if (k > 0) received += k;
+                else if (k == 0) return false;
+                else if (errno != EAGAIN && errno != EINTR) return false;
+            }
+        }
+        return true;
+    }
+};
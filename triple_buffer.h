@@ -0,0 +1,59 @@
+#pragma once
+
+// Hands the latest of a stream of values from one writer thread to one
+// reader thread without locks. There are three buffers: the writer fills
+// its back buffer and publishes it by swapping it with the middle one, the
+// reader takes the middle one in exchange for its front buffer when it
+// wants something newer. Neither side ever waits for the other; values
+// the reader did not get to in time are overwritten.
+//
+//     TripleBuffer<Frame> frames(args);   // each buffer is Frame(args)
+//
+//     // writer                           // reader
+//     fill(frames.write_buffer());        if (frames.update()){
+//     frames.publish();                       show(frames.read_buffer());
+//                                         }
+
+#include <atomic>
+
+template <typename T>
+struct TripleBuffer {
+    // set in middle while it holds a value the reader has not taken yet
+    static const int FRESH = 4;
+
+    T buffers[3];
+    // index of the buffer between the two sides, with FRESH
+    std::atomic<int> middle{1};
+    // owned by the writer
+    int back = 0;
+    // owned by the reader
+    int front = 2;
+
+    template <typename... Args>
+    TripleBuffer(const Args&... args): buffers{T(args...), T(args...), T(args...)}{}
+
+    TripleBuffer(const TripleBuffer&) = delete;
+    TripleBuffer& operator = (const TripleBuffer&) = delete;
+
+    T& write_buffer(){
+        return buffers[back];
+    }
+
+    // makes the write buffer the latest value, release so the reader sees
+    // everything written to it, acquire for the buffer coming back
+    void publish(){
+        back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & 3;
+    }
+
+    // switches the read buffer to the latest value, false if there is none
+    // since the last call
+    bool update(){
+        if (!(middle.load(std::memory_order_relaxed) & FRESH)) return false;
+        front = middle.exchange(front, std::memory_order_acq_rel) & 3;
+        return true;
+    }
+
+    const T& read_buffer() const {
+        return buffers[front];
+    }
+};
@@ -56,3 +56,41 @@ T smoothstep(const T &a, const T &b, const U &u){
     T t = clamp((u - a)/(b - a), U(0), U(1));
     return t*t*(U(3) - U(2)*t);
 }
+
+#ifdef __GNUC__
+#define VEC2_INLINE inline __attribute__((always_inline))
+// SIMD registers of 4, 8 and 16 floats
+typedef float float4v __attribute__((vector_size(16)));
+typedef float float8v __attribute__((vector_size(32)));
+typedef float float16v __attribute__((vector_size(64)));
+#else
+#define VEC2_INLINE inline
+#endif
+
+// vec2f with lanes: V is float or one of the float vectors above, so the
+// same code computes one cell or a whole register of cells at once.
+// Arguments are passed by reference, GCC notes the ABI of wide vector
+// arguments even where the pragma below is in effect.
+#ifdef __GNUC__
+#pragma GCC diagnostic push
+// returning wide vectors from always inlined functions does not touch the ABI
+#pragma GCC diagnostic ignored "-Wpsabi"
+#endif
+
+template <typename V>
+struct vec2v {
+    V x, y;
+};
+
+template <typename V>
+VEC2_INLINE vec2v<V> operator + (const vec2v<V> &a, const vec2v<V> &b){ return vec2v<V>{a.x + b.x, a.y + b.y}; }
+template <typename V>
+VEC2_INLINE vec2v<V> operator - (const vec2v<V> &a, const vec2v<V> &b){ return vec2v<V>{a.x - b.x, a.y - b.y}; }
+template <typename S, typename V>
+VEC2_INLINE vec2v<V> operator * (const S &a, const vec2v<V> &b){ return vec2v<V>{a * b.x, a * b.y}; }
+template <typename V>
+VEC2_INLINE V dot(const vec2v<V> &a, const vec2v<V> &b){ return a.x * b.x + a.y * b.y; }
+
+#ifdef __GNUC__
+#pragma GCC diagnostic pop
+#endif
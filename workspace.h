@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+#include "grid.h"
+
+// Scratch memory which is reused across steps. Blocks are handed out and
+// returned in stack order, so a step which asks for the same sizes as the
+// previous one gets the same memory back and does not allocate.
+struct Workspace {
+    struct Block {
+        void *data;
+        size_t bytes;
+    };
+
+    std::vector<Block> blocks;
+    int top = 0;
+    // number of times a block had to be allocated or grown
+    long allocations = 0;
+
+    Workspace(){}
+
+    Workspace(const Workspace&) = delete;
+    Workspace& operator = (const Workspace&) = delete;
+
+    ~Workspace(){
+        for (Block &block : blocks) aligned_free(block.data);
+    }
+
+    void* push(size_t bytes){
+        if (top == (int)blocks.size()){
+            blocks.push_back(Block{nullptr, 0});
+        }
+        Block &block = blocks[top++];
+        if (block.bytes < bytes){
+            aligned_free(block.data);
+            block.data = aligned_allocate(bytes);
+            block.bytes = bytes;
+            allocations++;
+        }
+        return block.data;
+    }
+
+    void pop(){
+        assert(top > 0);
+        top--;
+    }
+};
+
+// Grid backed by workspace memory for the lifetime of the object.
+// Contents are undefined after construction.
+template <typename T, typename Boundary = Periodic>
+struct ScratchGrid: Grid<T, Boundary> {
+    Workspace &workspace;
+
+    ScratchGrid(Workspace &workspace, int nx, int ny):
+        Grid<T, Boundary>(nx, ny, (T*)workspace.push(Grid<T, Boundary>::storage_size(nx, ny))),
+        workspace(workspace)
+    {}
+
+    ~ScratchGrid(){
+        workspace.pop();
+    }
+};